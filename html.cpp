@@ -1,4 +1,23 @@
 #include "html.hpp"
+#include <thread>
+#include <mutex>
+#include <deque>
+#include <exception>
+#include <system_error>
+#include <cstring>
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <unordered_map>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace html {
 
@@ -13,8 +32,366 @@ const std::unordered_set<std::string> void_tags = {"area", "base", "br", "col",
 const std::unordered_set<std::string> rawtext_tags = {"title", "textarea", "style", "script",
 	"noscript", "plaintext", "iframe", "xmp", "noembed", "noframes"};
 
+const std::unordered_set<std::string> boolean_attributes = {"allowfullscreen", "async", "autofocus",
+	"autoplay", "checked", "controls", "default", "defer", "disabled", "formnovalidate", "hidden",
+	"inert", "ismap", "itemscope", "loop", "multiple", "muted", "nomodule", "novalidate", "open",
+	"playsinline", "readonly", "required", "reversed", "selected"};
+
+const std::unordered_set<std::string> p_closing_tags = {"address", "article", "aside", "blockquote",
+	"details", "div", "dl", "fieldset", "figcaption", "figure", "footer", "form", "h1", "h2", "h3",
+	"h4", "h5", "h6", "header", "hgroup", "hr", "main", "menu", "nav", "ol", "p", "pre", "section",
+	"table", "ul"};
+
 const std::string space_chars(" \f\n\r\t\v");
 
+namespace {
+
+// Jobs are dealt round-robin to per-worker queues. A worker takes from the front of its own
+// queue and, once it runs dry, steals from the back of the others, so a few large jobs
+// landing on one worker do not leave the rest idle.
+class work_pool {
+public:
+	work_pool(size_t jobs, unsigned threads) : queues(threads), locks(new std::mutex[threads]) {
+		for(size_t i = 0; i < jobs; i++) {
+			queues[i % threads].push_back(i);
+		}
+	}
+	template<class F>
+	void run(F f) {
+		unsigned threads = static_cast<unsigned>(queues.size());
+		std::exception_ptr error;
+		std::mutex error_lock;
+		auto worker = [&](unsigned w) {
+			try {
+				size_t job;
+				while(take(w, job)) {
+					f(w, job);
+				}
+			} catch(...) {
+				std::lock_guard<std::mutex> lock(error_lock);
+				if(!error) {
+					error = std::current_exception();
+				}
+				for(unsigned i = 0; i < threads; i++) {
+					std::lock_guard<std::mutex> qlock(locks[i]);
+					queues[i].clear();
+				}
+			}
+		};
+		std::vector<std::thread> pool;
+		for(unsigned w = 1; w < threads; w++) {
+			pool.emplace_back(worker, w);
+		}
+		worker(0);
+		for(auto& t : pool) {
+			t.join();
+		}
+		if(error) {
+			std::rethrow_exception(error);
+		}
+	}
+private:
+	bool take(unsigned w, size_t& job) {
+		{
+			std::lock_guard<std::mutex> lock(locks[w]);
+			if(!queues[w].empty()) {
+				job = queues[w].front();
+				queues[w].pop_front();
+				return true;
+			}
+		}
+		for(size_t i = 1; i < queues.size(); i++) {
+			size_t v = (w + i) % queues.size();
+			std::lock_guard<std::mutex> lock(locks[v]);
+			if(!queues[v].empty()) {
+				job = queues[v].back();
+				queues[v].pop_back();
+				return true;
+			}
+		}
+		return false;
+	}
+	std::vector<std::deque<size_t>> queues;
+	std::unique_ptr<std::mutex[]> locks;
+};
+
+// Read-only view of a whole file, mapped where the platform allows it
+class file_map {
+public:
+	file_map(const std::string& path, bool sequential) {
+#ifdef _WIN32
+		(void)sequential;
+		std::ifstream in(path, std::ios::binary);
+		if(!in) {
+			throw std::system_error(std::make_error_code(std::errc::no_such_file_or_directory), path);
+		}
+		buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+		data = buffer.data();
+		size = buffer.size();
+#else
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if(fd < 0) {
+			throw std::system_error(errno, std::generic_category(), path);
+		}
+		struct stat st;
+		if(::fstat(fd, &st) < 0) {
+			int err = errno;
+			::close(fd);
+			throw std::system_error(err, std::generic_category(), path);
+		}
+		size = static_cast<size_t>(st.st_size);
+		if(size) {
+			void* addr = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if(addr == MAP_FAILED) {
+				int err = errno;
+				::close(fd);
+				throw std::system_error(err, std::generic_category(), path);
+			}
+			if(sequential) {
+				::madvise(addr, size, MADV_SEQUENTIAL);
+			}
+			data = static_cast<const char*>(addr);
+		}
+		::close(fd);
+#endif
+	}
+	file_map(const file_map&) = delete;
+	file_map& operator=(const file_map&) = delete;
+	~file_map() {
+#ifndef _WIN32
+		if(size) {
+			::munmap(const_cast<char*>(data), size);
+		}
+#endif
+	}
+	const char* data = "";
+	size_t size = 0;
+private:
+#ifdef _WIN32
+	std::string buffer;
+#endif
+};
+
+const size_t block_size = 64 * 1024;
+
+// Append the input up to the first `stop` character and leave `it` on the last appended one.
+// Limited strings take one character over the limit, so that the overflow is reported when the token is inserted
+inline size_t room(const std::string& out, size_t max) {
+	return !max ? std::string::npos : out.size() > max ? 0 : max + 1 - out.size();
+}
+
+inline void put(std::string& out, char c, size_t max) {
+	if(room(out, max)) {
+		out += c;
+	}
+}
+
+// Generic iterators append the current character only, contiguous input is scanned in bulk.
+template<class InputIt>
+inline void append_until(InputIt& it, InputIt, char, std::string& out, size_t max) {
+	put(out, *it, max);
+}
+
+template<class InputIt>
+inline void append_until(InputIt& it, InputIt, char, char, std::string& out, size_t max) {
+	put(out, *it, max);
+}
+
+inline void append_until(const char*& it, const char* end, char stop, std::string& out, size_t max) {
+	const char* p = static_cast<const char*>(std::memchr(it, stop, static_cast<size_t>(end - it)));
+	if(!p) {
+		p = end;
+	}
+	out.append(it, std::min(static_cast<size_t>(p - it), room(out, max)));
+	it = p - 1;
+}
+
+template<class InputIt>
+inline void skip_until(InputIt&, InputIt, char) {}
+
+inline void skip_until(const char*& it, const char* end, char stop) {
+	const char* p = static_cast<const char*>(std::memchr(it, stop, static_cast<size_t>(end - it)));
+	it = (p ? p : end) - 1;
+}
+
+inline void append_until(const char*& it, const char* end, char stop, char stop2, std::string& out, size_t max) {
+	const char* p = it + 1;
+	while(p != end && *p != stop && *p != stop2) {
+		p++;
+	}
+	out.append(it, std::min(static_cast<size_t>(p - it), room(out, max)));
+	it = p - 1;
+}
+
+template<class InputIt>
+inline bool short_of(InputIt, InputIt, size_t) {
+	return false;
+}
+
+inline bool short_of(const char* it, const char* end, size_t n) {
+	return static_cast<size_t>(end - it) < n;
+}
+
+// Whitespace in text content is `space_chars`, which unlike the tokenizer's also has \v
+inline bool is_text_space(char c) {
+	return utils::is_space(c) || c == '\v';
+}
+
+// Text made of tokenizer whitespace only, a lone \v is kept and written as a space
+bool is_blank(const std::string& str) {
+	return std::all_of(str.begin(), str.end(), [](char c) {
+		return utils::is_space(c);
+	});
+}
+
+unsigned pool_size(unsigned threads, size_t jobs) {
+	if(!threads) {
+		threads = std::thread::hardware_concurrency();
+	}
+	if(threads > jobs) {
+		threads = static_cast<unsigned>(jobs);
+	}
+	return threads ? threads : 1;
+}
+
+}
+
+template<class F>
+void node::each_attr(F f) const {
+	if(has_pooled()) {
+		for(auto& a : side->pooled) {
+			f(*a.name, a.get());
+		}
+	} else {
+		for(auto& a : attrs()) {
+			f(a.first, a.second);
+		}
+	}
+}
+
+// Output is appended to a string. With a sink the string is only a buffer that is handed
+// over in blocks, so large documents are never held in memory as a whole.
+class serializer {
+public:
+	serializer(std::string& out) : out(out) {}
+	serializer(std::string& buffer, const std::function<void(const char*, size_t)>& sink) : out(buffer), sink(&sink) {
+		out.reserve(block_size);
+	}
+	size_t size() const {
+		return flushed + out.size();
+	}
+	void write(char c) {
+		out += c;
+		check();
+	}
+	void write(const char* str, size_t n) {
+		out.append(str, n);
+		check();
+	}
+	void write(const std::string& str) {
+		write(str.data(), str.size());
+	}
+	void new_line(int deep, char ind) {
+		out += '\n';
+		out.append(static_cast<size_t>(deep), ind);
+		check();
+	}
+	void write_collapsed(const std::string&);
+	void write_text(const node&);
+	void write_open_tag(const node&);
+	void html(const node&, bool, bool, char);
+	void raw_html(const node&, bool, bool);
+	void write_plain(const char*, const char*);
+	bool write_minified_attribute(const std::string&, const std::string&);
+	void write_minified_text(const node&, const node*, const node*);
+	void minified(const node&);
+	void text(const node&, bool&);
+	void text(const node&, const text_options&);
+	void flush() {
+		if(sink && !out.empty()) {
+			(*sink)(out.data(), out.size());
+			flushed += out.size();
+			out.clear();
+		}
+	}
+	static size_t estimate(const node&);
+private:
+	void check() {
+		if(sink && out.size() >= block_size) {
+			flush();
+		}
+	}
+	std::string& out;
+	const std::function<void(const char*, size_t)>* sink = nullptr;
+	size_t flushed = 0;
+public:
+	// text output state, carried between text nodes
+	bool collapse = false;
+	bool space = false;
+	bool separate = false;
+};
+
+// Every run of whitespace is written as one space, as `utils::replace_any_copy` does
+void serializer::write_collapsed(const std::string& str) {
+	const char* p = str.data();
+	const char* end = p + str.size();
+	while(p != end) {
+		const char* space = std::find_if(p, end, is_text_space);
+		out.append(p, space);
+		if(space == end) {
+			break;
+		}
+		out += ' ';
+		p = std::find_if_not(space, end, is_text_space);
+	}
+	check();
+}
+
+void serializer::write_text(const node& n) {
+	if(n.parent && rawtext_tags.find(n.parent->tag_name) == rawtext_tags.end()) {
+		write_collapsed(n.content);
+	} else {
+		write(n.content);
+	}
+}
+
+void serializer::write_open_tag(const node& n) {
+	out += '<';
+	out += n.tag_name;
+	n.each_attr([this](const std::string& key, const std::string& value) {
+		out += ' ';
+		out += key;
+		out += "=\"";
+		out += value;
+		out += '"';
+	});
+	if(n.self_closing) {
+		out += " />";
+	} else {
+		out += '>';
+	}
+	check();
+}
+
+size_t serializer::estimate(const node& n) {
+	size_t size = 0;
+	auto add = [&size](const node& c) {
+		size += c.content.size();
+		if(c.type_node == node_t::tag) {
+			size += c.tag_name.size() * 2 + 6;
+			c.each_attr([&size](const std::string& key, const std::string& value) {
+				size += key.size() + value.size() + 4;
+			});
+		} else if(c.type_node == node_t::comment || c.type_node == node_t::doctype) {
+			size += 11;
+		}
+		return true;
+	};
+	add(n);
+	node::descend(n, add, [](const node&) {});
+	return size;
+}
+
 selector::selector(const std::string& s) {
 	selector_matcher matcher;
 	condition match_condition;
@@ -152,6 +529,64 @@ selector::selector(const std::string& s) {
 	} while(c || reconsume);
 }
 
+void selector::collect_attributes(std::unordered_set<std::string>& attributes) const {
+	for(auto& matcher : matchers) {
+		for(auto& conditions : matcher.conditions) {
+			for(auto& c : conditions) {
+				if(!c.id.empty()) {
+					attributes.insert("id");
+				}
+				if(!c.class_name.empty()) {
+					attributes.insert("class");
+				}
+				if(!c.attr.empty()) {
+					attributes.insert(c.attr);
+				}
+			}
+		}
+	}
+}
+
+const std::string* string_pool::intern(const std::string& str) {
+	std::lock_guard<std::mutex> lock(mutex);
+	return &*names.insert(str).first;
+}
+
+// Names are always pooled. Values are pooled while they are short and the pool has room,
+// the first values seen are the ones that repeat (class names, rel, type), the rest stay in the node.
+void string_pool::intern(node& n) {
+	// the map is sorted by name, so is the pooled list
+	auto& pooled = n.get_side().pooled;
+	pooled.reserve(n.attributes.size());
+	std::lock_guard<std::mutex> lock(mutex);
+	for(auto& a : n.attributes) {
+		node::pooled_attribute p = {&*names.insert(a.first).first, nullptr, std::string()};
+		if(a.second.size() <= max_value_size) {
+			auto it = values.find(a.second);
+			if(it != values.end()) {
+				p.value = &*it;
+			} else if(values.size() < max_values) {
+				p.value = &*values.insert(a.second).first;
+			}
+		}
+		if(!p.value) {
+			p.kept = std::move(a.second);
+		}
+		pooled.push_back(std::move(p));
+	}
+	n.attributes.clear();
+}
+
+size_t string_pool::size() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return names.size() + values.size();
+}
+
+parse_options& parse_options::keep_selector_attributes(const selector& s) {
+	s.collect_attributes(keep_attributes);
+	return *this;
+}
+
 selector::condition::condition(condition&& c) noexcept
 	: tag_name(std::move(c.tag_name))
 	, id(std::move(c.id))
@@ -180,66 +615,141 @@ selector::selector_matcher::selector_matcher(selector_matcher&& m) noexcept
 	m.conditions.clear();
 }
 
-bool selector::condition::operator()(const node& d) const {
+size_t flat_document::text_ref::find(const std::string& s, size_t pos) const {
+	if(pos > size) {
+		return std::string::npos;
+	}
+	const char* it = std::search(data + pos, data + size, s.begin(), s.end());
+	if(it == data + size && !s.empty()) {
+		return std::string::npos;
+	}
+	return static_cast<size_t>(it - data);
+}
+
+namespace {
+
+using text_ref = flat_document::text_ref;
+
+bool contains_word(const text_ref& str, const std::string& word) {
+	auto pos = str.find(word);
+	if(pos == std::string::npos) {
+		return false;
+	}
+	bool start = pos < 1 || utils::is_space(str.data[pos - 1]);
+	bool end = pos + word.size() >= str.size || utils::is_space(str.data[pos + word.size()]);
+	return start && end;
+}
+
+}
+
+// Elements seen by selectors: a node of a tree or an entry of a flat document,
+// attribute values are read in place from either
+struct selector::node_view {
+	const node& n;
+	node_t type() const {
+		return n.type_node;
+	}
+	const std::string& tag_name() const {
+		return n.tag_name;
+	}
+	text_ref find_attr(const std::string& key) const {
+		auto value = n.find_attr(key);
+		return value ? text_ref{value->data(), value->size()} : text_ref{nullptr, 0};
+	}
+	int index() const {
+		return n.index;
+	}
+	int last_index() const {
+		return n.parent->node_count - 1;
+	}
+};
+
+struct selector::flat_view {
+	const flat_document& doc;
+	flat_document::handle h;
+	node_t type() const {
+		return doc.type(h);
+	}
+	const std::string& tag_name() const {
+		return doc.tag_name(h);
+	}
+	text_ref find_attr(const std::string& key) const {
+		return doc.find_attr(h, key);
+	}
+	int index() const {
+		return static_cast<int>(doc.indices[h]);
+	}
+	int last_index() const {
+		return static_cast<int>(doc.element_counts[doc.parents[h]]) - 1;
+	}
+};
+
+template<class View>
+bool selector::condition::match(const View& d) const {
 	const int i = std::stoi(index);
 	if(!tag_name.empty()) {
-		return d.tag_name == tag_name;
+		return d.tag_name() == tag_name;
 	}
 	if(!id.empty()) {
-		auto it = d.attributes.find("id");
-		if(it != d.attributes.end()) {
-			return it->second == id;
+		auto value = d.find_attr("id");
+		if(value.data) {
+			return value == id;
 		}
 	}
 	if(!class_name.empty()) {
-		auto it = d.attributes.find("class");
-		if(it != d.attributes.end()) {
-			return utils::contains_word(it->second, class_name);
+		auto value = d.find_attr("class");
+		if(value.data) {
+			return contains_word(value, class_name);
 		}
 	}
 	if(attr_operator == "first") {
-		return d.index == 0;
+		return d.index() == 0;
 	}
 	if(attr_operator == "last") {
-		return d.index == d.parent->node_count - 1;
+		return d.index() == d.last_index();
 	}
 	if(attr_operator == "eq") {
-		return d.index == i;
+		return d.index() == i;
 	}
 	if(attr_operator == "gt") {
-		return d.index > i;
+		return d.index() > i;
 	}
 	if(attr_operator == "lt") {
-		return d.index < i;
+		return d.index() < i;
 	}
 	if(!attr.empty()) {
-		auto it = d.attributes.find(attr);
-		if(it == d.attributes.end()) {
+		auto value = d.find_attr(attr);
+		if(!value.data) {
 			return attr_operator == "!=";
 		}
 		if(attr_operator == "=") {
-			return it->second == attr_value;
+			return value == attr_value;
 		} else if(attr_operator == "^=") {
-			return it->second.find(attr_value) == 0;
+			return value.find(attr_value) == 0;
 		} else if(attr_operator == "$=") {
-			return attr_value.size() <= it->second.size() && it->second.find(attr_value) == it->second.size() - attr_value.size();
+			return attr_value.size() <= value.size && value.find(attr_value, value.size - attr_value.size()) != std::string::npos;
 		} else if(attr_operator == "!=") {
-			return it->second != attr_value;
+			return value != attr_value;
 		} else if(attr_operator == "*=") {
-			return it->second.find(attr_value) != std::string::npos;
+			return value.find(attr_value) != std::string::npos;
 		} else if(attr_operator == "~=") {
-			return utils::contains_word(it->second, attr_value);
+			return contains_word(value, attr_value);
 		} else if(attr_operator == "|=") {
-			return it->second.find(attr_value) == 0 && 
-				(attr_value.size() == it->second.size() || it->second[attr_value.size()] == '-');
+			return value.find(attr_value) == 0 &&
+				(attr_value.size() == value.size || value.data[attr_value.size()] == '-');
 		}
 		return true;
 	}
 	return false;
 }
 
-bool selector::selector_matcher::operator()(const node& d) const {
-	if(d.type_node != node_t::tag) {
+bool selector::condition::operator()(const node& d) const {
+	return match(node_view{d});
+}
+
+template<class View>
+bool selector::selector_matcher::match(const View& d) const {
+	if(d.type() != node_t::tag) {
 		return false;
 	}
 	if(this->all_match) {
@@ -248,7 +758,7 @@ bool selector::selector_matcher::operator()(const node& d) const {
 	for(auto& c : conditions) {
 		size_t i = 0;
 		for(; i < c.size(); i++) {
-			if(!c[i](d)) {
+			if(!c[i].match(d)) {
 				break;
 			}
 		}
@@ -259,6 +769,31 @@ bool selector::selector_matcher::operator()(const node& d) const {
 	return false;
 }
 
+bool selector::selector_matcher::operator()(const node& d) const {
+	return match(node_view{d});
+}
+
+// Whether the whole selector matches `n`, judged by its ancestors, for nodes seen one at a time
+bool selector::matches(const node& n) const {
+	return !matchers.empty() && matchers.back()(n) && matches_above(n, matchers.size() - 1);
+}
+
+// `n` matches matcher `i`, the previous matchers have to match its ancestors
+bool selector::matches_above(const node& n, size_t i) const {
+	if(i == 0) {
+		return true;
+	}
+	for(const node* p = n.parent; p; p = p->parent) {
+		if(matchers[i - 1](*p) && matches_above(*p, i - 1)) {
+			return true;
+		}
+		if(matchers[i].dc_second) {
+			break;
+		}
+	}
+	return false;
+}
+
 node::node(const node& d)
 	: type_node(d.type_node)
 	, type_tag(d.type_tag)
@@ -266,326 +801,1966 @@ node::node(const node& d)
 	, tag_name(d.tag_name)
 	, content(d.content)
 	, bogus_comment(d.bogus_comment)
-	, attributes(d.attributes) {
+	, hashed(d.hashed)
+	, attributes(d.has_pooled() ? d.attributes : d.attrs())
+	, source_begin(d.source_begin)
+	, source_end(d.source_end)
+	, hash(d.hash) {
+	if(d.has_pooled() || d.lazy()) {
+		auto& s = get_side();
+		s.pooled = d.side->pooled;
+		s.pool = d.side->pool;
+		s.lazy = d.side->lazy;
+	}
 	for(auto& n : d.children) {
-		copy(n.get(), this);
+		if(n) {
+			copy(n.get(), this);
+		}
+	}
+}
+
+node::~node() {
+	// the first levels are released recursively, the descendants below them from a flat list,
+	// so deep documents do not overflow the stack
+	static thread_local unsigned depth = 0;
+	if(depth < 64) {
+		depth++;
+		children.clear();
+		depth--;
+		return;
+	}
+	std::vector<node_ptr> pending;
+	for(auto& c : children) {
+		if(c) {
+			pending.push_back(std::move(c));
+		}
+	}
+	while(!pending.empty()) {
+		node_ptr n = std::move(pending.back());
+		pending.pop_back();
+		for(auto& c : n->children) {
+			if(c) {
+				pending.push_back(std::move(c));
+			}
+		}
+	}
+}
+
+void node::materialize() const {
+	lazy_children l = std::move(side->lazy);
+	side->lazy = lazy_children();
+	trim_side();
+	if(l.shared) {
+		// one level of the shared tree is copied, grandchildren stay shared until reached;
+		// the shared nodes are only read, removed slots are skipped instead of compacted
+		auto& from = l.shared->children;
+		children.reserve(from.size());
+		for(auto& c : from) {
+			if(!c) {
+				continue;
+			}
+			children.push_back(shallow_copy(*c, const_cast<node*>(this)));
+			node& copy = *children.back();
+			copy.slot = children.size() - 1;
+			copy.index = copy.type_node == node_t::tag ? node_count++ : 0;
+			share(copy, c.get(), l.shared_root);
+		}
+		return;
+	}
+	parser p(*l.options);
+	node root;
+	p.reset();
+	// a range that ends before the end of the input ends before the closing tag of the element
+	p.parse_range(root, l.source->data() + l.begin, l.source->data() + l.end, l.begin, l.end < l.source->size());
+	node_count = root.node_count;
+	children = std::move(root.children);
+	for(auto& c : children) {
+		c->parent = const_cast<node*>(this);
 	}
 }
 
-void node::walk(std::function<bool(node&)> handler) {
-	walk(*this, handler);
+node_ptr node::shallow_copy(const node& n, node* parent) {
+	auto ret = utils::make_unique<node>(parent);
+	ret->type_node = n.type_node;
+	ret->type_tag = n.type_tag;
+	ret->self_closing = n.self_closing;
+	ret->tag_name = n.tag_name;
+	ret->content = n.content;
+	// attributes are copied as stored, `n` may be shared and is not modified
+	ret->attributes = n.attributes;
+	if(n.side && (!n.side->raw_attributes.empty() || !n.side->pooled.empty())) {
+		auto& s = ret->get_side();
+		s.raw_attributes = n.side->raw_attributes;
+		s.pooled = n.side->pooled;
+		s.pool = n.side->pool;
+	}
+	ret->bogus_comment = n.bogus_comment;
+	ret->index = n.index;
+	ret->source_begin = n.source_begin;
+	ret->source_end = n.source_end;
+	ret->hash = n.hash;
+	ret->hashed = n.hashed;
+	return ret;
+}
+
+// The copy reads the children of `n` until it is changed
+void node::share(node& copy, const node* n, std::shared_ptr<const node> root) {
+	// a copy of a copy reads from the original document, and keeps that one alive
+	while(n->shared_node()) {
+		root = n->side->lazy.shared_root;
+		n = n->side->lazy.shared;
+	}
+	if(n->lazy()) {
+		// skimmed content of the original is parsed again for the copy
+		copy.get_side().lazy = n->side->lazy;
+	} else if(!n->children.empty()) {
+		auto& l = copy.get_side().lazy;
+		l.shared_root = std::move(root);
+		l.shared = n;
+	}
+}
+
+const std::vector<node_ptr>& node::nodes() const {
+	if(auto n = shared_node()) {
+		return n->children;
+	}
+	return child_nodes();
 }
 
-void node::walk(node& d, std::function<bool(node&)> handler) {
-	for(auto& c : d.children) {
-		if(handler(*c)) {
-			walk(*c, handler);
+// The node of this tree for `n`, a child read through this node; a clone copies one level for it
+node* node::own(const node& n) {
+	if(n.parent == this) {
+		return const_cast<node*>(&n);
+	}
+	size_t i = 0;
+	for(auto& c : n.parent->children) {
+		if(c.get() == &n) {
+			break;
 		}
+		i += c != nullptr;
 	}
+	return child_nodes()[i].get();
+}
+
+node_ptr clone(const std::shared_ptr<const node>& doc) {
+	auto ret = node::shallow_copy(*doc, nullptr);
+	ret->index = 0;
+	node::share(*ret, doc.get(), doc);
+	return ret;
 }
 
 std::vector<node*> node::select(const selector s, bool nested) {
-	std::vector<node*> matched_dom;
+	// nodes are matched as they are read, so a clone copies only the levels above the matched ones;
+	// a node read from a shared document is kept with the path to it from a node of this tree
+	struct match {
+		node* own;
+		std::vector<const node*> shared;
+	};
+	std::vector<match> matched_dom;
 	size_t msize = s.matchers.size();
 	if(msize) {
-		matched_dom.push_back(this);
+		matched_dom.push_back(match{this, {}});
 	}
+	// the nodes entered so far, with whether they belong to this tree
+	std::vector<std::pair<const node*, bool>> path;
 	size_t i = 0;
 	for(auto& matcher : s) {
 		auto selectee_dom = std::move(matched_dom);
-		for(auto p : selectee_dom) {
-			walk(*p, [&](node& n) {
+		for(auto& from : selectee_dom) {
+			path.assign(1, std::make_pair(from.own, true));
+			for(auto p : from.shared) {
+				path.emplace_back(p, false);
+			}
+			auto enter = [&](const node& n) {
+				bool mine = path.back().second && n.parent == path.back().first;
+				bool next = true;
 				if(matcher(n)) {
-					matched_dom.push_back(&n);
+					if(mine) {
+						matched_dom.push_back(match{const_cast<node*>(&n), {}});
+					} else {
+						size_t k = path.size();
+						while(!path[k - 1].second) {
+							k--;
+						}
+						matched_dom.push_back(match{const_cast<node*>(path[k - 1].first), {}});
+						for(; k < path.size(); k++) {
+							matched_dom.back().shared.push_back(path[k].first);
+						}
+						matched_dom.back().shared.push_back(&n);
+					}
 					if(matcher.dc_second) {
 						// div>[div]>div, div>div>[div] - not scan child, we need only direct child
-						return false;
+						next = false;
 					} else if(matcher.dc_first) {
 						// [div]>div>div - scan all child, since elements can be at any level
-						return true;
+						next = true;
 					} else if(i < msize - 1) {
 						// [div] div div, div [div] div - not scan child, the topmost parent will suffice
-						return false;
+						next = false;
 					} else {
 						// div div [div] - last matcher, scan based on attribute `nested`
-						return nested;
+						next = nested;
 					}
 				} else if(matcher.dc_second) {
-					return false;
+					next = false;
 				}
 				// if not match and not direct child, scan all child
-				return true;
-			});
+				if(next) {
+					path.emplace_back(&n, mine);
+				}
+				return next;
+			};
+			auto leave = [&](const node&) {
+				path.pop_back();
+			};
+			const node& start = *path.back().first;
+			descend(start, enter, leave);
 		}
 		i++;
 	}
-	return matched_dom;
+	std::vector<node*> ret;
+	ret.reserve(matched_dom.size());
+	for(auto& m : matched_dom) {
+		node* n = m.own;
+		for(auto p : m.shared) {
+			n = n->own(*p);
+		}
+		ret.push_back(n);
+	}
+	return ret;
 }
 
-void node::to_html(std::ostream& out, bool child, bool text, int level, int& deep, char ind, bool& last_is_block, bool& sibling_is_block) const {
-	std::streamoff pos = out.tellp();
-	if(type_node == node_t::none) {
-		for(auto& c : children) {
-			c->to_html(out, child, text, 0, deep, ind, last_is_block, sibling_is_block);
-		}
-	} else if(type_node == node_t::text) {
-		if(text && std::any_of(content.begin(), content.end(), [](char c) {
-			return !utils::is_space(c);
-		})) {
-			auto str = content;
-			if(parent && rawtext_tags.find(parent->tag_name) == rawtext_tags.end()) {
-				str = utils::replace_any_copy(str, space_chars, " ");
+void serializer::html(const node& root, bool child, bool text, char ind) {
+	// layout state of the children of every open element, documents share it with their parent
+	struct level_state {
+		int level;
+		bool last_is_block;
+		bool sibling_is_block;
+	};
+	node::scratch<level_state> lease;
+	auto& levels = lease.v;
+	levels.push_back(level_state{0, false, false});
+	int deep = 0;
+	auto enter = [&](const node& n) {
+		size_t pos = size();
+		level_state& s = levels.back();
+		if(n.type_node == node_t::none) {
+			levels.push_back(level_state{0, s.last_is_block, s.sibling_is_block});
+			return true;
+		} else if(n.type_node == node_t::text) {
+			if(text && !is_blank(n.content)) {
+				if(s.last_is_block) {
+					new_line(deep, ind);
+				}
+				write_text(n);
+				s.last_is_block = false;
 			}
-			if(last_is_block) {
-				out << '\n' << std::string(deep, ind);
+		} else if(n.type_node == node_t::tag) {
+			bool old_is_block = s.last_is_block;
+			s.last_is_block = inline_tags.find(n.tag_name) == inline_tags.end();
+			if(pos && (old_is_block || s.last_is_block)) {
+				new_line(deep, ind);
+				if(s.level && s.last_is_block && !s.sibling_is_block) {
+					s.sibling_is_block = true;
+					deep++;
+					write(ind);
+				}
+			}
+			write_open_tag(n);
+			if(!n.self_closing) {
+				if(child) {
+					levels.push_back(level_state{s.level + 1, false, false});
+					return true;
+				}
+				write("</", 2);
+				write(n.tag_name);
+				write('>');
 			}
-			out << str;
-			last_is_block = false;
-		}
-	} else if(type_node == node_t::tag) {
-		bool old_is_block = last_is_block;
-		last_is_block = inline_tags.find(tag_name) == inline_tags.end();
-		if(pos && (old_is_block || last_is_block)) {
-			out << '\n' << std::string(deep, ind);
-			if(level && last_is_block && !sibling_is_block) {
-				sibling_is_block = true;
-				deep++;
-				out << ind;
+		} else if(n.type_node == node_t::comment) {
+			if(s.last_is_block) {
+				new_line(deep, ind);
 			}
+			write("<!--", 4);
+			write(n.content);
+			write("-->", 3);
+			s.last_is_block = false;
+		} else if(n.type_node == node_t::doctype) {
+			write("<!DOCTYPE ", 10);
+			write(n.content);
+			write('>');
+			s.last_is_block = true;
+			s.sibling_is_block = true;
 		}
-		out << "<" << tag_name;
-		if(!attributes.empty()) {
-			for(auto& a : attributes) {
-				out << ' ' << a.first << "=\"" << a.second << "\"";
+		return false;
+	};
+	auto leave = [&](const node& n) {
+		level_state s = levels.back();
+		levels.pop_back();
+		if(n.type_node == node_t::none) {
+			levels.back().last_is_block = s.last_is_block;
+			levels.back().sibling_is_block = s.sibling_is_block;
+			return;
+		}
+		if(s.sibling_is_block) {
+			if(deep > 0) {
+				deep--;
 			}
+			new_line(deep, ind);
 		}
-		if(self_closing) {
-			out << " />";
-		} else {
-			out << ">";
-			if(child) {
-				bool last_is_block_n = false;
-				bool sibling_is_block_n = false;
-				for(auto& c : children) {
-					c->to_html(out, child, text, level + 1, deep, ind, last_is_block_n, sibling_is_block_n);
-				}
-				if(sibling_is_block_n) {
-					if(deep > 0) {
-						deep--;
-					}
-					out << '\n' << std::string(deep, ind);
+		write("</", 2);
+		write(n.tag_name);
+		write('>');
+	};
+	if(enter(root)) {
+		node::descend(root, enter, leave);
+		leave(root);
+	}
+}
+
+void serializer::raw_html(const node& root, bool child, bool text) {
+	auto enter = [&](const node& n) {
+		if(n.type_node == node_t::none) {
+			return true;
+		} else if(n.type_node == node_t::text) {
+			if(text && !is_blank(n.content)) {
+				write_text(n);
+			}
+		} else if(n.type_node == node_t::tag) {
+			write_open_tag(n);
+			if(!n.self_closing) {
+				if(child) {
+					return true;
 				}
+				write("</", 2);
+				write(n.tag_name);
+				write('>');
 			}
-			out << "</" << tag_name << ">";
+		} else if(n.type_node == node_t::comment) {
+			write("<!--", 4);
+			write(n.content);
+			write("-->", 3);
+		} else if(n.type_node == node_t::doctype) {
+			write("<!DOCTYPE ", 10);
+			write(n.content);
+			write('>');
+		}
+		return false;
+	};
+	auto leave = [this](const node& n) {
+		if(n.type_node == node_t::tag) {
+			write("</", 2);
+			write(n.tag_name);
+			write('>');
 		}
-	} else if(type_node == node_t::comment) {
-		if(last_is_block) {
-			out << '\n' << std::string(deep, ind);
+	};
+	if(enter(root)) {
+		node::descend(root, enter, leave);
+		leave(root);
+	}
+}
+
+namespace {
+
+bool is_kept_comment(const node& n) {
+	// conditional comments are the only ones with a meaning
+	return n.content.compare(0, 3, "[if") == 0;
+}
+
+bool is_block_boundary(const node* n) {
+	return !n || n->type_node == node_t::none || (n->type_node == node_t::tag && inline_tags.find(n->tag_name) == inline_tags.end());
+}
+
+bool is_dropped(const node& n) {
+	return n.type_node == node_t::comment && !is_kept_comment(n);
+}
+
+template<size_t N>
+bool is_one_of(const node* n, const char* const (&names)[N]) {
+	if(!n || n->type_node != node_t::tag) {
+		return false;
+	}
+	for(auto name : names) {
+		if(n->tag_name == name) {
+			return true;
 		}
-		out << "<!--" << content << "-->";
-		last_is_block = false;
-	} else if(type_node == node_t::doctype) {
-		out << "<!DOCTYPE " << content << ">";
-		last_is_block = true;
-		sibling_is_block = true;
 	}
+	return false;
+}
+
+// Closing tags that HTML allows to omit, `next` is the next emitted sibling
+bool is_optional_end(const node& n, const node* next) {
+	static const char* const li[] = {"li"};
+	static const char* const dt[] = {"dt", "dd"};
+	static const char* const option[] = {"option", "optgroup"};
+	static const char* const optgroup[] = {"optgroup"};
+	static const char* const tr[] = {"tr"};
+	static const char* const td[] = {"td", "th"};
+	static const char* const tbody[] = {"tbody", "tfoot"};
+	static const char* const p_parents[] = {"a", "audio", "del", "ins", "map", "noscript", "video"};
+	const std::string& tag = n.tag_name;
+	if(tag == "html" || tag == "head" || tag == "body") {
+		return true;
+	} else if(tag == "li") {
+		return !next || is_one_of(next, li);
+	} else if(tag == "dt") {
+		return is_one_of(next, dt);
+	} else if(tag == "dd") {
+		return !next || is_one_of(next, dt);
+	} else if(tag == "p") {
+		if(!next) {
+			return !is_one_of(n.get_parent(), p_parents);
+		}
+		return next->type_node == node_t::tag && p_closing_tags.find(next->tag_name) != p_closing_tags.end();
+	} else if(tag == "option") {
+		return !next || is_one_of(next, option);
+	} else if(tag == "optgroup") {
+		return !next || is_one_of(next, optgroup);
+	} else if(tag == "tr") {
+		return !next || is_one_of(next, tr);
+	} else if(tag == "td" || tag == "th") {
+		return !next || is_one_of(next, td);
+	} else if(tag == "thead") {
+		return is_one_of(next, tbody);
+	} else if(tag == "tbody") {
+		return !next || is_one_of(next, tbody);
+	} else if(tag == "tfoot") {
+		return !next;
+	}
+	return false;
+}
+
+}
+
+// Returns whether the value is written unquoted, which would take a following `/` in
+bool serializer::write_minified_attribute(const std::string& name, const std::string& value) {
+	write(' ');
+	write(name);
+	if(value.empty() || (value == name && boolean_attributes.find(name) != boolean_attributes.end())) {
+		return false;
+	}
+	write('=');
+	if(value.find_first_of(" \t\n\f\r\"'`=<>") == std::string::npos) {
+		write(value);
+		return true;
+	} else if(value.find('"') == std::string::npos) {
+		write('"');
+		write(value);
+		write('"');
+	} else if(value.find('\'') == std::string::npos) {
+		write('\'');
+		write(value);
+		write('\'');
+	} else {
+		write('"');
+		write(utils::replace_any_copy(value, "\"", "&quot;"));
+		write('"');
+	}
+	return false;
+}
+
+// Whitespace next to a block boundary is dropped, other runs of whitespace become one space
+void serializer::write_minified_text(const node& n, const node* prev, const node* next) {
+	const char* begin = n.content.data();
+	const char* end = begin + n.content.size();
+	if(is_block_boundary(next ? next : n.parent)) {
+		while(end != begin && is_text_space(*(end - 1))) {
+			end--;
+		}
+	}
+	collapse = true;
+	if(!prev || prev->type_node != node_t::text) {
+		space = is_block_boundary(prev ? prev : n.parent);
+	}
+	write_plain(begin, end);
+}
+
+void serializer::minified(const node& root) {
+	// state of the children of every open element
+	struct level_state {
+		const std::vector<node_ptr>* children;
+		bool preserve;
+		bool close;
+		size_t i;
+		size_t written;
+		const node* prev;
+	};
+	node::scratch<level_state> lease;
+	auto& levels = lease.v;
+	auto open = [&](const node& n, bool preserve, bool close) {
+		if(n.type_node == node_t::tag) {
+			write('<');
+			write(n.tag_name);
+			bool unquoted = false;
+			n.each_attr([this, &unquoted](const std::string& key, const std::string& value) {
+				unquoted = write_minified_attribute(key, value);
+			});
+			if(n.self_closing) {
+				if(void_tags.find(n.tag_name) == void_tags.end()) {
+					if(unquoted) {
+						write(' ');
+					}
+					write("/>", 2);
+				} else {
+					write('>');
+				}
+				return false;
+			}
+			write('>');
+			preserve = preserve || n.tag_name == "pre" || rawtext_tags.find(n.tag_name) != rawtext_tags.end();
+		} else if(n.type_node == node_t::text) {
+			write(n.content);
+			return false;
+		} else if(n.type_node == node_t::comment) {
+			write("<!--", 4);
+			write(n.content);
+			write("-->", 3);
+			return false;
+		} else if(n.type_node == node_t::doctype) {
+			write("<!DOCTYPE ", 10);
+			write(n.content);
+			write('>');
+			return false;
+		}
+		levels.push_back(level_state{&n.nodes(), preserve, close, 0, 0, nullptr});
+		return true;
+	};
+	auto enter = [&](const node& c) {
+		level_state& s = levels.back();
+		auto& children = *s.children;
+		// removed nodes leave empty slots, which are not entered
+		while(children[s.i].get() != &c) {
+			s.i++;
+		}
+		size_t i = s.i++;
+		if(is_dropped(c)) {
+			return false;
+		}
+		auto is_written = [&s](const node* n) {
+			return n && !is_dropped(*n) && (n->type_node != node_t::text || s.preserve || !is_blank(n->content));
+		};
+		// whitespace next to a block element is not written, so it does not count for closing tags
+		if(s.written <= i) {
+			s.written = i + 1;
+			while(s.written < children.size() && !is_written(children[s.written].get())) {
+				s.written++;
+			}
+		}
+		const node* next_written = s.written < children.size() ? children[s.written].get() : nullptr;
+		const node* prev = s.prev;
+		s.prev = &c;
+		if(c.type_node == node_t::text && !s.preserve) {
+			write_minified_text(c, prev, next_written);
+			return false;
+		}
+		return open(c, s.preserve, !is_optional_end(c, next_written));
+	};
+	auto leave = [&](const node& n) {
+		bool close = levels.back().close;
+		levels.pop_back();
+		if(n.type_node == node_t::tag && close) {
+			write("</", 2);
+			write(n.tag_name);
+			write('>');
+		}
+	};
+	if(open(root, false, true)) {
+		node::descend(root, enter, leave);
+		leave(root);
+	}
+}
+
+std::string node::to_minified_html() const {
+	std::string ret;
+	serializer out(ret);
+	out.minified(*this);
+	return ret;
+}
+
+void node::to_minified_html(std::function<void(const char*, size_t)> sink) const {
+	std::string buffer;
+	serializer out(buffer, sink);
+	out.minified(*this);
+	out.flush();
+}
+
+void node::to_minified_html(std::ostream& out) const {
+	to_minified_html([&out](const char* data, size_t size) {
+		out.write(data, static_cast<std::streamsize>(size));
+	});
+}
+
+std::string node::to_html(char ind, bool child, bool text) const {
+	std::string ret;
+	serializer out(ret);
+	out.html(*this, child, text, ind);
+	return ret;
+}
+
+void node::to_html(std::function<void(const char*, size_t)> sink, char ind, bool child, bool text) const {
+	std::string buffer;
+	serializer out(buffer, sink);
+	out.html(*this, child, text, ind);
+	out.flush();
+}
+
+void node::to_html(std::ostream& out, char ind, bool child, bool text) const {
+	to_html([&out](const char* data, size_t size) {
+		out.write(data, static_cast<std::streamsize>(size));
+	}, ind, child, text);
+}
+
+std::string node::to_raw_html(bool child, bool text) const {
+	std::string ret;
+	serializer out(ret);
+	out.raw_html(*this, child, text);
+	return ret;
+}
+
+void node::to_raw_html(std::function<void(const char*, size_t)> sink, bool child, bool text) const {
+	std::string buffer;
+	serializer out(buffer, sink);
+	out.raw_html(*this, child, text);
+	out.flush();
+}
+
+void node::to_raw_html(std::ostream& out, bool child, bool text) const {
+	to_raw_html([&out](const char* data, size_t size) {
+		out.write(data, static_cast<std::streamsize>(size));
+	}, child, text);
+}
+
+// With `collapse` every run of whitespace is written as one space, also across calls
+void serializer::write_plain(const char* p, const char* end) {
+	if(!collapse) {
+		out.append(p, end);
+	} else {
+		while(p != end) {
+			const char* blank = std::find_if(p, end, is_text_space);
+			if(blank != p) {
+				out.append(p, blank);
+				space = false;
+			}
+			if(blank == end) {
+				break;
+			}
+			if(!space) {
+				out += ' ';
+				space = true;
+			}
+			p = std::find_if_not(blank, end, is_text_space);
+		}
+	}
+	check();
+}
+
+void serializer::text(const node& root, bool& is_block) {
+	// whether each entered node is a block element
+	node::scratch<char> lease;
+	auto& blocks = lease.v;
+	auto enter = [&](const node& n) {
+		size_t pos = size();
+		if(n.type_node == node_t::none) {
+			blocks.push_back(false);
+			return true;
+		} else if(n.type_node == node_t::text) {
+			if(is_block) {
+				if(pos) {
+					write_plain("\n", "\n" + 1);
+				}
+				is_block = false;
+			}
+			write_plain(n.content.data(), n.content.data() + n.content.size());
+		} else if(n.type_node == node_t::tag) {
+			if(n.tag_name == "br") {
+				write_plain("\n", "\n" + 1);
+			}
+			bool is_block_n = inline_tags.find(n.tag_name) == inline_tags.end();
+			if(is_block_n) {
+				is_block = true;
+			}
+			blocks.push_back(is_block_n);
+			return true;
+		}
+		return false;
+	};
+	auto leave = [&](const node&) {
+		if(blocks.back()) {
+			is_block = true;
+		}
+		blocks.pop_back();
+	};
+	if(enter(root)) {
+		node::descend(root, enter, leave);
+		leave(root);
+	}
+}
+
+void serializer::text(const node& root, const text_options& o) {
+	// whether each entered node is a block element
+	node::scratch<char> lease;
+	auto& blocks = lease.v;
+	auto enter = [&](const node& n) {
+		if(n.type_node == node_t::text) {
+			const char* p = n.content.data();
+			const char* end = p + n.content.size();
+			if(o.collapse) {
+				p = std::find_if_not(p, end, is_text_space);
+				if(p == end) {
+					space = true;
+					return false;
+				}
+			} else if(p == end) {
+				return false;
+			}
+			if(separate) {
+				// separators and spaces are written only between two pieces of text
+				if(size()) {
+					write(o.separator);
+				}
+				separate = false;
+				space = false;
+			} else if((space || p != n.content.data()) && size()) {
+				write(' ');
+			}
+			if(o.on_text) {
+				o.on_text(n, size());
+			}
+			space = false;
+			if(o.collapse) {
+				collapse = true;
+				const char* last = end;
+				while(is_text_space(*(last - 1))) {
+					last--;
+				}
+				write_plain(p, last);
+				space = last != end;
+			} else {
+				write_plain(p, end);
+			}
+		} else if(n.type_node == node_t::tag || n.type_node == node_t::none) {
+			if(n.type_node == node_t::tag) {
+				if(n.tag_name == "br") {
+					separate = true;
+					return false;
+				}
+				if(o.skip_rawtext && rawtext_tags.find(n.tag_name) != rawtext_tags.end()) {
+					return false;
+				}
+			}
+			bool block = n.type_node == node_t::tag && inline_tags.find(n.tag_name) == inline_tags.end();
+			if(block) {
+				separate = true;
+			}
+			blocks.push_back(block);
+			return true;
+		}
+		return false;
+	};
+	auto leave = [&](const node&) {
+		if(blocks.back()) {
+			separate = true;
+		}
+		blocks.pop_back();
+	};
+	if(enter(root)) {
+		node::descend(root, enter, leave);
+		leave(root);
+	}
+}
+
+std::string node::to_text(bool raw) const {
+	std::string ret;
+	serializer out(ret);
+	out.collapse = raw;
+	bool is_block = false;
+	out.text(*this, is_block);
+	return ret;
+}
+
+std::string node::to_text(const text_options& o) const {
+	std::string ret;
+	serializer out(ret);
+	out.text(*this, o);
+	return ret;
+}
+
+void node::to_text(std::function<void(const char*, size_t)> sink, const text_options& o) const {
+	std::string buffer;
+	serializer out(buffer, sink);
+	out.text(*this, o);
+	out.flush();
+}
+
+std::string node::source_html(const std::string& src) const {
+	if(source_begin >= src.size()) {
+		return std::string();
+	}
+	return src.substr(source_begin, source_end - source_begin);
+}
+
+std::map<std::string, std::string>& node::attrs() const {
+	if(!side) {
+		return attributes;
+	}
+	auto& pooled = side->pooled;
+	if(!pooled.empty()) {
+		// the map is needed to change attributes, pooled strings are copied back
+		for(auto& a : pooled) {
+			attributes.emplace(*a.name, a.get());
+		}
+		std::vector<pooled_attribute>().swap(pooled);
+		side->pool.reset();
+	}
+	auto& raw_attributes = side->raw_attributes;
+	if(!raw_attributes.empty()) {
+		// attributes recorded by a lazy parse are tokenized on first access, by a parser kept per thread;
+		// a lazy parse has no attribute options, and the node is changed by the first read, even a const one
+		static thread_local parser p;
+		p.reset();
+		p.next_token();
+		p.state = parser::state_t::before_attribute_name;
+		p.tokenize(raw_attributes.data(), raw_attributes.data() + raw_attributes.size());
+		if(p.state == parser::state_t::attribute_name) {
+			p.store_attribute();
+		}
+		attributes = std::move(p.new_node->attributes);
+		std::string().swap(raw_attributes);
+	}
+	trim_side();
+	return attributes;
+}
+
+const std::string* node::find_attr(const std::string& key) const {
+	if(has_pooled()) {
+		auto& pooled = side->pooled;
+		auto it = std::lower_bound(pooled.begin(), pooled.end(), key, [](const pooled_attribute& a, const std::string& k) {
+			return *a.name < k;
+		});
+		return it != pooled.end() && *it->name == key ? &it->get() : nullptr;
+	}
+	auto& map = attrs();
+	auto it = map.find(key);
+	return it != map.end() ? &it->second : nullptr;
+}
+
+size_t node::attr_count() const {
+	return has_pooled() ? side->pooled.size() : attrs().size();
+}
+
+bool node::has_attr(const std::string& key) const {
+	return find_attr(key) != nullptr;
+}
+
+std::string node::get_attr(const std::string& attr) const {
+	auto value = find_attr(attr);
+	if(!value) {
+		return std::string();
+	}
+	return *value;
+}
+
+void node::set_attr(const std::string& key, const std::string& val) {
+	attrs()[key] = val;
+	invalidate_hash();
+}
+
+void node::set_attr(const std::map<std::string, std::string>& attr) {
+	if(side) {
+		side->raw_attributes.clear();
+		side->pooled.clear();
+		side->pool.reset();
+		trim_side();
+	}
+	attributes = attr;
+	invalidate_hash();
+}
+
+void node::del_attr(const std::string& key) {
+	attrs().erase(key);
+	invalidate_hash();
+}
+
+void node::invalidate_hash() {
+	// the whole chain is cleared: the levels a clone copies from a shared document start without
+	// a hash, while the clone above them may already be hashed
+	for(node* n = this; n; n = n->parent) {
+		n->hashed = false;
+	}
+}
+
+void node::copy(const node* from, node* to) {
+	// source nodes with the copy their copies are appended to, in reverse document order
+	std::vector<std::pair<const node*, node*>> pending(1, std::make_pair(from, to));
+	// only the target may be lazy or hold removed slots, the copies are built here
+	to->child_nodes();
+	while(!pending.empty()) {
+		const node* n = pending.back().first;
+		node* p = pending.back().second;
+		pending.pop_back();
+		auto new_node = utils::make_unique<node>();
+		new_node->parent = p;
+		new_node->type_node = n->type_node;
+		new_node->type_tag = n->type_tag;
+		new_node->self_closing = n->self_closing;
+		new_node->tag_name = n->tag_name;
+		new_node->content = n->content;
+		if(!n->has_pooled()) {
+			new_node->attributes = n->attrs();
+		}
+		new_node->bogus_comment = n->bogus_comment;
+		new_node->source_begin = n->source_begin;
+		new_node->source_end = n->source_end;
+		new_node->hash = n->hash;
+		new_node->hashed = n->hashed;
+		auto& siblings = p->children;
+		if(new_node->type_node == node_t::tag) {
+			new_node->index = p->node_count++;
+		}
+		if(n->has_pooled() || n->lazy()) {
+			auto& s = new_node->get_side();
+			s.pooled = n->side->pooled;
+			s.pool = n->side->pool;
+			s.lazy = n->side->lazy;
+		}
+		for(auto it = n->children.rbegin(); it != n->children.rend(); ++it) {
+			if(*it) {
+				pending.emplace_back(it->get(), new_node.get());
+			}
+		}
+		new_node->slot = siblings.size();
+		siblings.push_back(std::move(new_node));
+	}
+}
+
+node& node::append(const node& n) {
+	copy(&n, this);
+	invalidate_hash();
+	return *this;
+}
+
+node& node::append(node&& n) {
+	return append(utils::make_unique<node>(std::move(n)));
+}
+
+node& node::append(node_ptr n) {
+	if(lazy()) {
+		materialize();
+	}
+	// a stale node renumbers its children later, so the index may be wrong here
+	n->parent = this;
+	n->index = n->type_node == node_t::tag ? node_count++ : 0;
+	n->slot = children.size();
+	children.push_back(std::move(n));
+	invalidate_hash();
+	return *this;
+}
+
+node& node::adopt(node& n) {
+	if(!n.parent) {
+		throw std::invalid_argument("adopted node has no parent");
+	}
+	for(node* p = this; p; p = p->parent) {
+		if(p == &n) {
+			throw std::invalid_argument("node cannot adopt its ancestor");
+		}
+	}
+	return append(n.detach());
+}
+
+node& node::splice(node& from) {
+	for(node* p = this; p; p = p->parent) {
+		if(p == &from) {
+			throw std::invalid_argument("node cannot splice children of its ancestor");
+		}
+	}
+	auto& moved = from.child_nodes();
+	auto& siblings = child_nodes();
+	siblings.reserve(siblings.size() + moved.size());
+	for(auto& c : moved) {
+		if(!c) {
+			continue;
+		}
+		c->parent = this;
+		c->index = c->type_node == node_t::tag ? node_count++ : 0;
+		c->slot = siblings.size();
+		siblings.push_back(std::move(c));
+	}
+	moved.clear();
+	from.node_count = 0;
+	from.invalidate_hash();
+	invalidate_hash();
+	return *this;
+}
+
+node& node::insert_before(const node& n) {
+	return insert_before(utils::make_unique<node>(n));
+}
+
+node& node::insert_before(node&& n) {
+	return insert_before(utils::make_unique<node>(std::move(n)));
+}
+
+node& node::insert_before(node_ptr n) {
+	if(!parent) {
+		throw std::invalid_argument("node has no parent");
+	}
+	size_t i = position();
+	auto& siblings = parent->children;
+	// later siblings move right, so their slots stay lower bounds
+	n->parent = parent;
+	n->slot = i;
+	node& ret = *n;
+	siblings.insert(siblings.begin() + i, std::move(n));
+	parent->stale = true;
+	parent->invalidate_hash();
+	return ret;
+}
+
+node_ptr node::replace_with(const node& n) {
+	return replace_with(utils::make_unique<node>(n));
+}
+
+node_ptr node::replace_with(node&& n) {
+	return replace_with(utils::make_unique<node>(std::move(n)));
+}
+
+node_ptr node::replace_with(node_ptr n) {
+	if(!parent) {
+		throw std::invalid_argument("node has no parent");
+	}
+	size_t i = position();
+	node* p = parent;
+	n->parent = p;
+	n->slot = i;
+	n.swap(p->children[i]);
+	p->stale = true;
+	p->invalidate_hash();
+	parent = nullptr;
+	index = 0;
+	return n;
+}
+
+node_ptr node::detach() {
+	if(!parent) {
+		throw std::invalid_argument("node has no parent");
+	}
+	node* p = parent;
+	// the slot is left empty until the children of the parent are accessed again
+	node_ptr ret = std::move(p->children[position()]);
+	p->stale = true;
+	p->holes = true;
+	p->invalidate_hash();
+	parent = nullptr;
+	index = 0;
+	return ret;
+}
+
+void node::remove() {
+	detach();
+}
+
+void node::renumber() const {
+	// a traversal may be iterating the children, then empty slots stay until it has finished
+	if(holes && !walking()) {
+		holes = false;
+		children.erase(std::remove(children.begin(), children.end(), nullptr), children.end());
+	}
+	stale = false;
+	slotted = true;
+	node_count = 0;
+	for(size_t i = 0; i < children.size(); i++) {
+		if(children[i]) {
+			node& c = *children[i];
+			c.slot = i;
+			c.index = c.type_node == node_t::tag ? node_count++ : 0;
+		}
+	}
+}
+
+node* node::nth(size_t i) const {
+	for(auto& c : children) {
+		if(c && !i--) {
+			return c.get();
+		}
+	}
+	return nullptr;
+}
+
+size_t node::count() const {
+	return static_cast<size_t>(std::count_if(children.begin(), children.end(), [](const node_ptr& c) {
+		return c != nullptr;
+	}));
+}
+
+size_t node::position() const {
+	auto& siblings = parent->children;
+	if(!parent->slotted) {
+		parent->renumber();
+	}
+	size_t i = slot;
+	while(siblings[i].get() != this) {
+		i++;
+	}
+	return i;
+}
+
+parser::parser(const parser& p)
+	: options(p.options)
+	, attributes_kept(p.attributes_kept)
+	, callback_node(p.callback_node)
+	, callback_err(p.callback_err) {}
+
+parser::parser(const parse_options& o) : options(o) {
+	update_attributes_kept();
+}
+
+parser& parser::set_options(const parse_options& o) {
+	options = o;
+	update_attributes_kept();
+	return *this;
+}
+
+parser& parser_pool::local() {
+	struct entry {
+		std::weak_ptr<const int> pool;
+		std::unique_ptr<parser> p;
+	};
+	// parsers of this thread are released when it exits, those of destroyed pools on the next call
+	static thread_local std::vector<entry> parsers;
+	parsers.erase(std::remove_if(parsers.begin(), parsers.end(), [](const entry& e) {
+		return e.pool.expired();
+	}), parsers.end());
+	for(auto& e : parsers) {
+		if(!e.pool.owner_before(token) && !token.owner_before(e.pool)) {
+			return *e.p;
+		}
+	}
+	parsers.push_back(entry{token, utils::make_unique<parser>(proto)});
+	return *parsers.back().p;
+}
+
+namespace {
+
+inline uint64_t rotate(uint64_t v, int r) {
+	return (v << r) | (v >> (64 - r));
+}
+
+inline uint64_t mix(uint64_t v) {
+	v ^= v >> 33;
+	v *= 0xff51afd7ed558ccdULL;
+	v ^= v >> 33;
+	v *= 0xc4ceb9fe1a85ec53ULL;
+	return v ^ (v >> 33);
+}
+
+// Two independent 64-bit lanes over 8-byte words, for cache keys only
+void hash_bytes(const char* data, size_t size, uint64_t (&out)[2]) {
+	uint64_t a = 0x9e3779b97f4a7c15ULL ^ size;
+	uint64_t b = 0xc2b2ae3d27d4eb4fULL + size;
+	size_t i = 0;
+	for(; i + 8 <= size; i += 8) {
+		uint64_t w;
+		std::memcpy(&w, data + i, 8);
+		a = rotate(a ^ (w * 0x87c37b91114253d5ULL), 31) * 0x4cf5ad432745937fULL;
+		b = rotate(b + w, 27) * 0x52dce729ULL + a;
+	}
+	uint64_t w = 0;
+	std::memcpy(&w, data + i, size - i);
+	a ^= w * 0x87c37b91114253d5ULL;
+	b += w;
+	out[0] = mix(a + b);
+	out[1] = mix(b ^ rotate(a, 17));
+}
+
+size_t node_memory(const node& root) {
+	size_t size = 0;
+	std::vector<const node*> pending(1, &root);
+	while(!pending.empty()) {
+		const node* n = pending.back();
+		pending.pop_back();
+		size += sizeof(node) + n->size() * sizeof(node_ptr);
+		for(auto& c : *n) {
+			if(c) {
+				pending.push_back(c.get());
+			}
+		}
+	}
+	return size;
+}
+
+parser immutable_parser(const parser& proto) {
+	// cached documents are shared between threads, so nothing may be materialized on first read
+	parser p(proto);
+	parse_options o = p.get_options();
+	o.lazy_attributes = false;
+	o.skim_depth = -1;
+	p.set_options(o);
+	return p;
+}
+
+}
+
+namespace {
+
+inline void combine(uint64_t& h, uint64_t v) {
+	h = mix(h ^ (v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2)));
+}
+
+inline uint64_t hash_string(const std::string& str) {
+	uint64_t out[2];
+	hash_bytes(str.data(), str.size(), out);
+	return out[0];
+}
+
+bool same_node(const node& a, const node& b) {
+	return a.type_node == b.type_node && a.self_closing == b.self_closing &&
+		a.tag_name == b.tag_name && a.content == b.content;
+}
+
+// Children read with a const walk, which does not copy the levels of a clone
+std::vector<const node*> children_of(const node& n) {
+	std::vector<const node*> ret;
+	n.walk([&ret](const node& c) {
+		ret.push_back(&c);
+		return false;
+	});
+	return ret;
+}
+
+void collect_changes(const node& a, const node& b, std::vector<std::pair<const node*, const node*>>& out) {
+	// pairs are compared in document order
+	std::vector<std::pair<const node*, const node*>> pending(1, std::make_pair(&a, &b));
+	while(!pending.empty()) {
+		const node& x = *pending.back().first;
+		const node& y = *pending.back().second;
+		pending.pop_back();
+		if(x.subtree_hash() == y.subtree_hash()) {
+			continue;
+		}
+		auto xs = children_of(x);
+		auto ys = children_of(y);
+		// the opening tag carries the attributes
+		if(!same_node(x, y) || xs.size() != ys.size() || (x.type_node == node_t::tag && x.to_raw_html(false) != y.to_raw_html(false))) {
+			out.emplace_back(&x, &y);
+			continue;
+		}
+		for(size_t i = xs.size(); i-- > 0;) {
+			pending.emplace_back(xs[i], ys[i]);
+		}
+	}
+}
+
+}
+
+uint64_t node::subtree_hash() const {
+	if(!hashed) {
+		// nodes a clone reads from a shared document are not written, their hashes are kept here
+		std::unordered_map<const node*, uint64_t> local;
+		// the number of nodes on the path that are shared or read their children from a shared document
+		size_t shared = shared_node() != nullptr;
+		auto value = [&local](const node& n) {
+			return n.hashed ? n.hash : local[&n];
+		};
+		// children are hashed before their parent, hashed subtrees are not entered
+		auto update = [&](const node& n) {
+			// type_tag is left out: elements in a tree are open tags, or none when built by hand
+			uint64_t h = static_cast<uint64_t>(n.type_node) << 1 | n.self_closing;
+			combine(h, hash_string(n.tag_name));
+			combine(h, hash_string(n.content));
+			n.each_attr([&h](const std::string& key, const std::string& value) {
+				combine(h, hash_string(key));
+				combine(h, hash_string(value));
+			});
+			auto& children = n.nodes();
+			size_t count = 0;
+			for(auto& c : children) {
+				count += c != nullptr;
+			}
+			combine(h, count);
+			for(auto& c : children) {
+				if(c) {
+					combine(h, value(*c));
+				}
+			}
+			return h;
+		};
+		auto enter = [&](const node& n) {
+			if(n.hashed) {
+				return false;
+			}
+			if(shared || n.shared_node()) {
+				shared++;
+			}
+			return true;
+		};
+		auto leave = [&](const node& n) {
+			uint64_t h = update(n);
+			if(shared > 1 || (shared == 1 && !n.shared_node())) {
+				local[&n] = h;
+			} else {
+				n.hash = h;
+				n.hashed = true;
+			}
+			if(shared) {
+				shared--;
+			}
+		};
+		descend(*this, enter, leave);
+		hash = update(*this);
+		hashed = true;
+	}
+	return hash;
+}
+
+std::vector<std::pair<const node*, const node*>> diff(const node& a, const node& b) {
+	std::vector<std::pair<const node*, const node*>> ret;
+	collect_changes(a, b, ret);
+	return ret;
+}
+
+parse_cache::parse_cache(size_t memory_limit, const parser& proto) : pool(immutable_parser(proto)), memory_limit(memory_limit) {}
+
+std::shared_ptr<const node> parse_cache::parse(const std::string& html) {
+	return parse(html.data(), html.size());
+}
+
+std::shared_ptr<const node> parse_cache::parse(const char* html, size_t size) {
+	key k;
+	hash_bytes(html, size, k.hash);
+	k.size = size;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = index.find(k);
+		if(it != index.end()) {
+			entries.splice(entries.begin(), entries, it->second);
+			hit_count++;
+			return it->second->doc;
+		}
+	}
+	miss_count++;
+	std::shared_ptr<const node> doc = pool.local().parse(html, size);
+	size_t memory = node_memory(*doc) + serializer::estimate(*doc);
+	if(memory > memory_limit) {
+		return doc;
+	}
+	// cached documents are read by several threads, hashes are filled in before they are shared
+	doc->subtree_hash();
+	std::lock_guard<std::mutex> lock(mutex);
+	if(index.count(k)) {
+		return doc;
+	}
+	entries.push_front(entry{k, doc, memory});
+	index.emplace(k, entries.begin());
+	memory_used += memory;
+	while(memory_used > memory_limit) {
+		memory_used -= entries.back().memory;
+		index.erase(entries.back().id);
+		entries.pop_back();
+	}
+	return doc;
+}
+
+size_t parse_cache::memory() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return memory_used;
+}
+
+void parse_cache::clear() {
+	std::lock_guard<std::mutex> lock(mutex);
+	index.clear();
+	entries.clear();
+	memory_used = 0;
+}
+
+const flat_document::handle flat_document::npos;
+
+namespace {
+
+// arrays of a flat document built from a tree
+struct flat_columns {
+	std::vector<uint8_t> types;
+	std::vector<uint8_t> self_closed;
+	std::vector<uint32_t> tags;
+	std::vector<flat_document::handle> parents;
+	std::vector<flat_document::handle> first_children;
+	std::vector<flat_document::handle> next_siblings;
+	std::vector<flat_document::handle> ends;
+	std::vector<uint32_t> text_begin;
+	std::vector<uint32_t> text_size;
+	std::vector<uint32_t> child_begin;
+	std::vector<flat_document::handle> children;
+	std::vector<uint32_t> indices;
+	std::vector<uint32_t> element_counts;
+	std::vector<uint32_t> attr_begin;
+	std::vector<uint32_t> attr_names;
+	std::vector<uint32_t> attr_value_begin;
+	std::vector<uint32_t> attr_value_size;
+	std::string text;
+};
+
+}
+
+flat_document::flat_document(const node& root) {
+	auto columns = std::make_shared<flat_columns>();
+	flat_columns& c = *columns;
+	std::unordered_map<std::string, uint32_t> atom_ids;
+	auto atom = [&](const std::string& name) {
+		auto it = atom_ids.find(name);
+		if(it != atom_ids.end()) {
+			return it->second;
+		}
+		atoms.push_back(name);
+		return atom_ids.emplace(name, static_cast<uint32_t>(atoms.size() - 1)).first->second;
+	};
+	atom(std::string());
+	// open nodes, each with its last child so far
+	std::vector<std::pair<handle, handle>> open;
+	auto add = [&](const node& n) {
+		if(c.types.size() >= npos) {
+			throw std::length_error("document has too many nodes");
+		}
+		if(c.text.size() + n.content.size() > UINT32_MAX || c.attr_names.size() + n.attr_count() > UINT32_MAX) {
+			throw std::length_error("document exceeds 4 GiB");
+		}
+		handle h = static_cast<handle>(c.types.size());
+		handle p = open.empty() ? npos : open.back().first;
+		c.types.push_back(static_cast<uint8_t>(n.type_node));
+		c.self_closed.push_back(n.self_closing);
+		c.tags.push_back(atom(n.tag_name));
+		c.parents.push_back(p);
+		c.first_children.push_back(npos);
+		c.next_siblings.push_back(npos);
+		c.ends.push_back(h + 1);
+		c.text_begin.push_back(static_cast<uint32_t>(c.text.size()));
+		c.text_size.push_back(static_cast<uint32_t>(n.content.size()));
+		c.text += n.content;
+		c.indices.push_back(0);
+		c.element_counts.push_back(0);
+		c.attr_begin.push_back(static_cast<uint32_t>(c.attr_names.size()));
+		n.each_attr([&](const std::string& key, const std::string& value) {
+			if(c.text.size() + value.size() > UINT32_MAX) {
+				throw std::length_error("document exceeds 4 GiB");
+			}
+			c.attr_names.push_back(atom(key));
+			c.attr_value_begin.push_back(static_cast<uint32_t>(c.text.size()));
+			c.attr_value_size.push_back(static_cast<uint32_t>(value.size()));
+			c.text += value;
+		});
+		if(p != npos) {
+			handle& last = open.back().second;
+			if(last == npos) {
+				c.first_children[p] = h;
+			} else {
+				c.next_siblings[last] = h;
+			}
+			last = h;
+			if(n.type_node == node_t::tag) {
+				c.indices[h] = c.element_counts[p]++;
+			}
+		}
+		open.emplace_back(h, npos);
+	};
+	add(root);
+	root.visit([&add](const node& n) {
+		add(n);
+		return visit_t::next;
+	}, [&c, &open](const node&) {
+		c.ends[open.back().first] = static_cast<handle>(c.types.size());
+		open.pop_back();
+		return visit_t::next;
+	});
+	handle count = static_cast<handle>(c.types.size());
+	c.ends[0] = count;
+	c.attr_begin.push_back(static_cast<uint32_t>(c.attr_names.size()));
+	// children are listed per node once the siblings are linked
+	c.child_begin.reserve(count + 1);
+	c.children.reserve(count - 1);
+	for(handle h = 0; h < count; h++) {
+		c.child_begin.push_back(static_cast<uint32_t>(c.children.size()));
+		for(handle k = c.first_children[h]; k != npos; k = c.next_siblings[k]) {
+			c.children.push_back(k);
+		}
+	}
+	c.child_begin.push_back(static_cast<uint32_t>(c.children.size()));
+	types = column<uint8_t>(c.types.data(), count);
+	self_closed = column<uint8_t>(c.self_closed.data(), count);
+	tags = column<uint32_t>(c.tags.data(), count);
+	parents = column<handle>(c.parents.data(), count);
+	first_children = column<handle>(c.first_children.data(), count);
+	next_siblings = column<handle>(c.next_siblings.data(), count);
+	ends = column<handle>(c.ends.data(), count);
+	text_begin = column<uint32_t>(c.text_begin.data(), count);
+	text_size = column<uint32_t>(c.text_size.data(), count);
+	child_begin = column<uint32_t>(c.child_begin.data(), count + 1);
+	children = column<handle>(c.children.data(), c.children.size());
+	indices = column<uint32_t>(c.indices.data(), count);
+	element_counts = column<uint32_t>(c.element_counts.data(), count);
+	attr_begin = column<uint32_t>(c.attr_begin.data(), count + 1);
+	attr_names = column<uint32_t>(c.attr_names.data(), c.attr_names.size());
+	attr_value_begin = column<uint32_t>(c.attr_value_begin.data(), c.attr_value_begin.size());
+	attr_value_size = column<uint32_t>(c.attr_value_size.data(), c.attr_value_size.size());
+	text = column<char>(c.text.data(), c.text.size());
+	storage = std::move(columns);
+}
+
+flat_document::text_ref flat_document::find_attr(handle h, const std::string& key) const {
+	for(uint32_t i = attr_begin[h]; i < attr_begin[h + 1]; i++) {
+		if(atoms[attr_names[i]] == key) {
+			return text_ref{text.data() + attr_value_begin[i], attr_value_size[i]};
+		}
+	}
+	return text_ref{nullptr, 0};
+}
+
+std::vector<std::pair<std::string, std::string>> flat_document::attributes(handle h) const {
+	std::vector<std::pair<std::string, std::string>> ret;
+	for(uint32_t i = attr_begin[h]; i < attr_begin[h + 1]; i++) {
+		ret.emplace_back(atoms[attr_names[i]], std::string(text.data() + attr_value_begin[i], attr_value_size[i]));
+	}
+	return ret;
+}
+
+std::vector<flat_document::handle> flat_document::select(const selector& s, handle from, bool nested) const {
+	// the same rules as node::select, skipping a subtree is a jump to its end
+	std::vector<handle> matched;
+	size_t msize = s.matchers.size();
+	if(msize && from < size()) {
+		matched.push_back(from);
+	}
+	size_t i = 0;
+	for(auto& matcher : s) {
+		auto selectee = std::move(matched);
+		for(handle p : selectee) {
+			for(handle h = p + 1; h < ends[p];) {
+				bool descend;
+				if(matcher.match(selector::flat_view{*this, h})) {
+					matched.push_back(h);
+					if(matcher.dc_second) {
+						descend = false;
+					} else if(matcher.dc_first) {
+						descend = true;
+					} else if(i < msize - 1) {
+						descend = false;
+					} else {
+						descend = nested;
+					}
+				} else {
+					descend = !matcher.dc_second;
+				}
+				h = descend ? h + 1 : ends[h];
+			}
+		}
+		i++;
+	}
+	return matched;
+}
+
+void parser::operator()(node& nodeptr) {
+	for(auto& c : callback_node) {
+		if(!c.first) {
+			c.second(nodeptr);
+			continue;
+		}
+		auto it = c.first.begin();
+		if((*it)(nodeptr)) {
+			it++;
+		}
+		if(it == c.first.end()) {
+			c.second(nodeptr);
+		}
+	}
+}
+
+parser& parser::set_callback(std::function<void(node&)> cb) {
+	callback_node.push_back(std::make_pair(selector(), cb));
+	return *this;
+}
+
+parser& parser::set_callback(const selector selector, std::function<void(node&)> cb) {
+	callback_node.push_back(std::make_pair(selector, cb));
+	update_attributes_kept();
+	return *this;
+}
+
+parser& parser::set_callback(std::function<void(err_t, node&)> cb) {
+	callback_err.push_back(cb);
+	return *this;
+}
+
+void parser::clear_callbacks() {
+	callback_node.clear();
+	callback_err.clear();
+	update_attributes_kept();
 }
 
-void node::to_raw_html(std::ostream& out, bool child, bool text) const {
-	if(type_node == node_t::none) {
-		for(auto& c : children) {
-			c->to_raw_html(out, child, text);
-		}
-	} else if(type_node == node_t::text) {
-		if(text && std::any_of(content.begin(), content.end(), [](char c) {
-			return !utils::is_space(c);
-		})) {
-			auto str = content;
-			if(parent && rawtext_tags.find(parent->tag_name) == rawtext_tags.end()) {
-				str = utils::replace_any_copy(str, space_chars, " ");
-			}
-			out << str;
-		}
-	} else if(type_node == node_t::tag) {
-		out << "<" << tag_name;
-		if(!attributes.empty()) {
-			for(auto& a : attributes) {
-				out << ' ' << a.first << "=\"" << a.second << "\"";
-			}
-		}
-		if(self_closing) {
-			out << " />";
-		} else {
-			out << ">";
-			if(child) {
-				for(auto& c : children) {
-					c->to_raw_html(out, child, text);
-				}
+template<class InputIt>
+void parser::handle_node(InputIt it) {
+	token_end = position(it) + 1;
+	handle_node();
+}
+
+void parser::handle_node() {
+	node* new_node_ptr = new_node.get();
+	if(new_node_ptr->type_node == node_t::text) {
+		// text is flushed when the next token starts or at the end of input
+		new_node_ptr->source_begin = token_begin;
+		new_node_ptr->source_end = tag_begin;
+	} else {
+		new_node_ptr->source_begin = tag_begin;
+		new_node_ptr->source_end = token_end;
+	}
+	token_begin = new_node_ptr->source_end;
+	if(watched && ++since_check == check_interval) {
+		check_deadline();
+	}
+	if(tokens) {
+		if(new_node_ptr->type_node != node_t::text || !new_node_ptr->content.empty()) {
+			if(new_node_ptr->type_node == node_t::tag && new_node_ptr->type_tag == tag_t::open && !new_node_ptr->self_closing &&
+				void_tags.find(new_node_ptr->tag_name) == void_tags.end() && rawtext_tags.find(new_node_ptr->tag_name) != rawtext_tags.end()) {
+				current_ptr = new_node_ptr;
+				state = state_t::rawtext;
+				skip_rawtext = is_pruned(*new_node_ptr);
 			}
-			out << "</" << tag_name << ">";
+			tokens->push_back(std::move(new_node));
 		}
-	} else if(type_node == node_t::comment) {
-		out << "<!--" << content << "-->";
-	} else if(type_node == node_t::doctype) {
-		out << "<!DOCTYPE " << content << ">";
+	} else {
+		insert_node(new_node);
 	}
+	next_token();
 }
 
-std::string node::to_html(char ind, bool child, bool text) const {
-	std::stringstream ret;
-	bool last_is_block_n = false;
-	bool sibling_is_block_n = false;
-	int deep = 0;
-	to_html(ret, child, text, 0, deep, ind, last_is_block_n, sibling_is_block_n);
-	return ret.str();
+void parser::next_token() {
+	if(new_node) {
+		// the previous token did not make it into the tree, reuse it along with its string capacity
+		new_node->type_tag = tag_t::none;
+		new_node->self_closing = false;
+		new_node->bogus_comment = false;
+		new_node->attributes_cut = false;
+		new_node->tag_name.clear();
+		new_node->content.clear();
+		new_node->attributes.clear();
+		new_node->side.reset();
+	} else {
+		new_node = utils::make_unique<node>();
+	}
+	new_node->parent = current_ptr;
+	new_node->type_node = node_t::text;
 }
 
-std::string node::to_raw_html(bool child, bool text) const {
-	std::stringstream ret;
-	to_raw_html(ret, child, text);
-	return ret.str();
+void parser::reset() {
+	state = state_t::data;
+	current_ptr = nullptr;
+	tokens = nullptr;
+	pruned.reset();
+	skip_rawtext = false;
+	attr_value = nullptr;
+	lazy = false;
+	raw_begin = nullptr;
+	key.clear();
+	token_begin = tag_begin = token_end = 0;
+	depth = 0;
+	kept_depth = -1;
+	skimming = nullptr;
+	skim_stack.clear();
+	skim_size = 0;
+	source.reset();
+	stopped = false;
+	nodes = 0;
+	dropped.clear();
+	since_check = 0;
+	limited = options.max_depth || options.max_nodes || options.max_attributes || options.max_attribute_length || options.max_text;
+	watched = options.cancel || options.timeout.count();
+	deadline = options.timeout.count() ? std::chrono::steady_clock::now() + options.timeout : std::chrono::steady_clock::time_point::max();
 }
 
-void node::to_text(std::ostream& out, bool& is_block) const {
-	std::streamoff pos = out.tellp();
-	if(type_node == node_t::none) {
-		for(auto& c : children) {
-			c->to_text(out, is_block);
-		}
-	} else if(type_node == node_t::text) {
-		if(is_block) {
-			if(pos) {
-				out << '\n';
-			}
-			is_block = false;
-		}
-		out << content;
-	} else if(type_node == node_t::tag) {
-		if(tag_name == "br") {
-			out << '\n';
-		}
-		bool is_block_n = inline_tags.find(tag_name) == inline_tags.end();
-		if(is_block_n) {
-			is_block = true;
-		}
-		for(auto& c : children) {
-			c->to_text(out, is_block);
-		}
-		if(is_block_n) {
-			is_block = true;
-		}
+const char* parser::keep_source(const char* begin, const char* end) {
+	if(options.skim_depth < 0) {
+		return begin;
 	}
+	// skimmed elements parse their children later from a shared copy of the input
+	source = std::make_shared<const std::string>(begin, end);
+	if(!skim_options || skim_options->skim_depth >= 0) {
+		auto o = std::make_shared<parse_options>(options);
+		o->skim_depth = -1;
+		skim_options = o;
+	}
+	return source->data();
 }
 
-std::string node::to_text(bool raw) const {
-	std::stringstream ret;
-	bool is_block = false;
-	to_text(ret, is_block);
-	auto str = ret.str();
-	if(raw) {
-		str = utils::replace_any_copy(str, space_chars, " ");
+void parser::parse_range(node& root, const char* begin, const char* end, size_t offset, bool closed) {
+	current_ptr = &root;
+	next_token();
+	token_begin = offset;
+	tokenize_block(begin, end, offset);
+	if(closed && state == state_t::tag_open) {
+		// the closing tag after the range writes out a pending `<` as text
+		put(new_node->content, '<', options.max_text);
+		state = state_t::data;
 	}
-	return str;
+	finish(offset + static_cast<size_t>(end - begin));
 }
 
-bool node::has_attr(const std::string& key) const {
-	return attributes.count(key);
+const char* parser::tokenize_block(const char* begin, const char* end, size_t offset, bool last) {
+	block_begin = begin;
+	block_offset = offset;
+	return tokenize(begin, end, last);
 }
 
-std::string node::get_attr(const std::string& attr) const {
-	auto it = attributes.find(attr);
-	if(it == attributes.end()) {
-		return std::string();
+void parser::finish(size_t end) {
+	new_node->type_node = node_t::text;
+	tag_begin = end;
+	handle_node();
+	if(stopped) {
+		end = token_begin;
 	}
-	return it->second;
+	if(skimming) {
+		end_skim(end);
+	}
+	close_elements(end);
 }
 
-void node::set_attr(const std::string& key, const std::string& val) {
-	attributes[key] = val;
+void parser::close_elements(size_t end) {
+	// elements still open end where the input ends
+	for(node* n = current_ptr; n; n = n->parent) {
+		n->source_end = end;
+	}
 }
 
-void node::set_attr(const std::map<std::string, std::string>& attr) {
-	attributes = attr;
+void parser::end_skim(size_t end) {
+	if(end > skim_begin) {
+		auto& l = skimming->get_side().lazy;
+		l.source = source;
+		l.options = skim_options;
+		l.begin = skim_begin;
+		l.end = end;
+	}
+	skimming = nullptr;
 }
 
-void node::del_attr(const std::string& key) {
-	attributes.erase(key);
+void parser::skim_node(node_ptr& token) {
+	node* new_node_ptr = token.get();
+	if(new_node_ptr->type_node != node_t::tag) {
+		return;
+	}
+	if(new_node_ptr->type_tag == tag_t::open) {
+		if(new_node_ptr->self_closing || void_tags.find(new_node_ptr->tag_name) != void_tags.end()) {
+			return;
+		}
+		if(rawtext_tags.find(new_node_ptr->tag_name) != rawtext_tags.end()) {
+			// kept only to find the end of rawtext, the same way as pruned elements
+			pruned = std::move(token);
+			current_ptr = new_node_ptr;
+			state = state_t::rawtext;
+			skip_rawtext = true;
+		} else {
+			if(skim_size < skim_stack.size()) {
+				skim_stack[skim_size] = new_node_ptr->tag_name;
+			} else {
+				skim_stack.push_back(new_node_ptr->tag_name);
+			}
+			skim_size++;
+		}
+		return;
+	}
+	if(pruned && current_ptr == pruned.get()) {
+		current_ptr = current_ptr->parent;
+		pruned.reset();
+		return;
+	}
+	for(size_t i = skim_size; i-- > 0;) {
+		if(skim_stack[i] == new_node_ptr->tag_name) {
+			skim_size = i;
+			return;
+		}
+	}
+	for(node* p = current_ptr; p->parent; p = p->parent) {
+		if(p->tag_name == new_node_ptr->tag_name) {
+			// closes the skimmed element or one of its ancestors
+			end_skim(new_node_ptr->source_begin);
+			insert_node(token);
+			return;
+		}
+	}
 }
 
-void node::copy(const node* n, node* p) {
-	auto new_node = utils::make_unique<node>();
-	new_node->parent = p;
-	new_node->type_node = n->type_node;
-	new_node->type_tag = n->type_tag;
-	new_node->self_closing = n->self_closing;
-	new_node->tag_name = n->tag_name;
-	new_node->content = n->content;
-	new_node->attributes = n->attributes;
-	new_node->bogus_comment = n->bogus_comment;
-	if(new_node->type_node == node_t::tag) {
-		new_node->index = p->node_count++;
+void parser::store_attribute() {
+	if(lazy || skimming) {
+		attr_value = nullptr;
+	} else if(!attributes_kept.empty() && attributes_kept.find(key) == attributes_kept.end()) {
+		attr_value = nullptr;
+	} else if(options.max_attributes && new_node->attributes.size() >= options.max_attributes && !new_node->attributes.count(key)) {
+		// the first attributes in document order are kept, the tag is reported when it is inserted
+		new_node->attributes_cut = true;
+		attr_value = nullptr;
+	} else {
+		attr_value = &new_node->attributes[key];
 	}
-	for(auto& c : n->children) {
-		copy(c.get(), new_node.get());
+}
+
+void parser::report(err_t e, node& n) {
+	for(auto& c : callback_err) {
+		c(e, n);
 	}
-	p->children.push_back(std::move(new_node));
 }
 
-node& node::append(const node& n) {
-	copy(&n, this);
-	return *this;
+bool parser::check_deadline() {
+	since_check = 0;
+	if(options.cancel && options.cancel->load(std::memory_order_relaxed)) {
+		stopped = true;
+		report(err_t::cancelled, *current_ptr);
+	} else if(std::chrono::steady_clock::now() >= deadline) {
+		stopped = true;
+		report(err_t::timeout, *current_ptr);
+	}
+	return stopped;
 }
 
-void parser::operator()(node& nodeptr) {
-	for(auto& c : callback_node) {
-		if(!c.first) {
-			c.second(nodeptr);
-			continue;
+bool parser::check_limits(node_ptr& token) {
+	node& n = *token;
+	if(n.type_node == node_t::tag && n.type_tag == tag_t::close) {
+		auto d = dropped.find(n.tag_name);
+		if(d != dropped.end()) {
+			// ends an element left out for its depth
+			if(!--d->second) {
+				dropped.erase(d);
+			}
+			return false;
 		}
-		auto it = c.first.begin();
-		if((*it)(nodeptr)) {
-			it++;
+		// rawtext content is stored in the closing tag
+		if(options.max_text && n.content.size() > options.max_text) {
+			n.content.resize(options.max_text);
+			report(err_t::text_too_long, n);
 		}
-		if(it == c.first.end()) {
-			c.second(nodeptr);
+		return true;
+	}
+	if(n.type_node == node_t::text && n.content.empty()) {
+		return true;
+	}
+	if(options.max_nodes && nodes >= options.max_nodes) {
+		stopped = true;
+		report(err_t::too_many_nodes, *current_ptr);
+		return false;
+	}
+	nodes++;
+	if(n.type_node == node_t::tag) {
+		if(options.max_depth && static_cast<size_t>(depth) >= options.max_depth) {
+			report(err_t::too_deep, *current_ptr);
+			if(n.self_closing || void_tags.find(n.tag_name) != void_tags.end()) {
+				return false;
+			}
+			if(rawtext_tags.find(n.tag_name) != rawtext_tags.end()) {
+				// kept only to find the end of rawtext, the same way as pruned elements
+				pruned = std::move(token);
+				current_ptr = pruned.get();
+				depth++;
+				state = state_t::rawtext;
+				skip_rawtext = true;
+			} else {
+				// its content goes to the current element, its closing tag is ignored
+				dropped[n.tag_name]++;
+			}
+			return false;
+		}
+		if(n.attributes_cut) {
+			n.attributes_cut = false;
+			report(err_t::too_many_attributes, n);
+		}
+		if(options.max_attribute_length) {
+			for(auto& a : n.attributes) {
+				if(a.second.size() > options.max_attribute_length) {
+					a.second.resize(options.max_attribute_length);
+					report(err_t::attribute_too_long, n);
+				}
+			}
 		}
+	} else if(options.max_text && n.content.size() > options.max_text) {
+		n.content.resize(options.max_text);
+		report(err_t::text_too_long, n);
 	}
+	return true;
 }
 
-parser& parser::set_callback(std::function<void(node&)> cb) {
-	callback_node.push_back(std::make_pair(selector(), cb));
-	return *this;
+void parser::capture_from(const char* it) {
+	if(lazy) {
+		raw_begin = it;
+	}
 }
 
-parser& parser::set_callback(const selector selector, std::function<void(node&)> cb) {
-	callback_node.push_back(std::make_pair(selector, cb));
-	return *this;
+void parser::capture_to(const char* it) {
+	if(raw_begin) {
+		if(it != raw_begin) {
+			new_node->get_side().raw_attributes.append(raw_begin, it);
+		}
+		raw_begin = nullptr;
+	}
 }
 
-parser& parser::set_callback(std::function<void(err_t, node&)> cb) {
-	callback_err.push_back(cb);
-	return *this;
+void parser::update_attributes_kept() {
+	attributes_kept.clear();
+	if(!options.keep_attributes.empty()) {
+		attributes_kept = options.keep_attributes;
+		for(auto& c : callback_node) {
+			c.first.collect_attributes(attributes_kept);
+		}
+		options.skim_filter.collect_attributes(attributes_kept);
+	}
 }
 
-void parser::clear_callbacks() {
-	callback_node.clear();
-	callback_err.clear();
+bool parser::is_pruned(const node& n) const {
+	return options.prune != prune_t::none && options.prune_tags.find(n.tag_name) != options.prune_tags.end() &&
+		rawtext_tags.find(n.tag_name) != rawtext_tags.end();
 }
 
-void parser::handle_node() {
-	node* new_node_ptr = new_node.get();
+void parser::insert_node(node_ptr& token) {
+	node* new_node_ptr = token.get();
+	new_node_ptr->parent = current_ptr;
+	if(skimming) {
+		skim_node(token);
+		return;
+	}
+	if(limited && !check_limits(token)) {
+		return;
+	}
 	if(new_node_ptr->type_node == node_t::tag) {
 		if(new_node_ptr->type_tag == tag_t::open) {
+			if(options.prune == prune_t::element && is_pruned(*new_node_ptr)) {
+				if(!new_node_ptr->self_closing) {
+					// kept out of the tree only to match the closing tag
+					pruned = std::move(token);
+					current_ptr = new_node_ptr;
+					depth++;
+					state = state_t::rawtext;
+					skip_rawtext = true;
+				}
+				return;
+			}
+			if(options.pool && !new_node_ptr->attributes.empty()) {
+				options.pool->intern(*new_node_ptr);
+				new_node_ptr->side->pool = options.pool;
+			}
 			new_node_ptr->index = current_ptr->node_count++;
-			current_ptr->children.push_back(std::move(new_node));
+			current_ptr->children.push_back(std::move(token));
 			if(!new_node_ptr->self_closing) {
 				if(void_tags.find(new_node_ptr->tag_name) != void_tags.end()) {
 					new_node_ptr->self_closing = true;
 				} else if(rawtext_tags.find(new_node_ptr->tag_name) != rawtext_tags.end()) {
 					current_ptr = new_node_ptr;
+					depth++;
 					state = state_t::rawtext;
+					skip_rawtext = is_pruned(*new_node_ptr);
 				} else {
 					current_ptr = new_node_ptr;
+					if(source && kept_depth < 0) {
+						// elements matching the filter are built with all their descendants
+						if(options.skim_filter && options.skim_filter.matches(*new_node_ptr)) {
+							kept_depth = depth;
+						} else if(depth >= options.skim_depth) {
+							skimming = new_node_ptr;
+							skim_begin = new_node_ptr->source_end;
+							skim_size = 0;
+						}
+					}
+					depth++;
 				}
 			}
 			(*this)(*new_node_ptr);
@@ -602,65 +2777,238 @@ void parser::handle_node() {
 						c(err_t::tag_not_closed, *n);
 					}
 				}
-				if(!new_node_ptr->content.empty()) {
+				if(!new_node_ptr->content.empty() && !(options.drop_whitespace && is_blank(new_node_ptr->content))) {
 					auto text_node = utils::make_unique<node>(current_ptr);
 					text_node->type_node = node_t::text;
 					text_node->content = std::move(new_node_ptr->content);
+					text_node->source_begin = current_ptr->source_end;
+					text_node->source_end = new_node_ptr->source_begin;
 					new_node_ptr->content.clear();
 					current_ptr->children.push_back(std::move(text_node));
 				}
+				for(auto n : not_closed) {
+					n->source_end = new_node_ptr->source_begin;
+				}
+				_current_ptr->source_end = new_node_ptr->source_end;
 				current_ptr = _current_ptr->parent;
-				(*this)(*new_node_ptr);
+				depth -= static_cast<int>(not_closed.size()) + 1;
+				if(depth <= kept_depth) {
+					kept_depth = -1;
+				}
+				if(pruned && _current_ptr == pruned.get()) {
+					pruned.reset();
+				} else {
+					// elements left out for their depth are closed with it
+					if(!dropped.empty()) {
+						dropped.clear();
+					}
+					(*this)(*new_node_ptr);
+				}
 			}
 		}
 	} else if(new_node_ptr->type_node == node_t::text) {
-		if(!new_node_ptr->content.empty()) {
-			current_ptr->children.push_back(std::move(new_node));
+		if(!new_node_ptr->content.empty() && !(options.drop_whitespace && is_blank(new_node_ptr->content))) {
+			current_ptr->children.push_back(std::move(token));
 			(*this)(*new_node_ptr);
 		}
+	} else if(new_node_ptr->type_node == node_t::comment && options.drop_comments) {
+		return;
+	} else if(new_node_ptr->type_node == node_t::doctype && options.drop_doctype) {
+		return;
 	} else {
-		current_ptr->children.push_back(std::move(new_node));
+		current_ptr->children.push_back(std::move(token));
 		(*this)(*new_node_ptr);
 	}
-	new_node = utils::make_unique<node>(current_ptr);
-	new_node->type_node = node_t::text;
 }
 
 node_ptr html::parser::parse(const std::string& html) {
-	return parser::parse(html.begin(), html.end());
+	return parser::parse(html.data(), html.data() + html.size());
+}
+
+node_ptr html::parser::parse(const char* html) {
+	return parser::parse(html, html + std::strlen(html));
+}
+
+node_ptr html::parser::parse(const char* html, size_t size) {
+	return parser::parse(html, html + size);
+}
+
+node_ptr html::parser::parse(const std::vector<char>& html) {
+	return parser::parse(html.data(), html.data() + html.size());
+}
+
+node_ptr html::parser::parse(const char* begin, const char* end) {
+	reset();
+	const char* data = keep_source(begin, end);
+	auto _parent = utils::make_unique<node>();
+	parse_range(*_parent, data, data + (end - begin), 0);
+	return _parent;
+}
+
+node_ptr html::parser::parse_file(const std::string& path, bool sequential) {
+	file_map file(path, sequential);
+	return parser::parse(file.data, file.data + file.size);
 }
 
 node_ptr html::parser::parse(std::istream& html) {
-	return parser::parse(std::istreambuf_iterator<char>(html), std::istreambuf_iterator<char>());
+	if(options.skim_depth >= 0) {
+		std::string str((std::istreambuf_iterator<char>(html)), std::istreambuf_iterator<char>());
+		return parser::parse(str);
+	}
+	reset();
+	auto _parent = utils::make_unique<node>();
+	current_ptr = _parent.get();
+	next_token();
+	std::unique_ptr<char[]> block(new char[block_size]);
+	size_t kept = 0;
+	size_t offset = 0;
+	bool last = false;
+	while(!last && !stopped) {
+		html.read(block.get() + kept, static_cast<std::streamsize>(block_size - kept));
+		const char* end = block.get() + kept + static_cast<size_t>(html.gcount());
+		last = !html;
+		const char* stop = tokenize_block(block.get(), end, offset, last);
+		offset += static_cast<size_t>(stop - block.get());
+		kept = static_cast<size_t>(end - stop);
+		std::memmove(block.get(), stop, kept);
+	}
+	finish(offset + kept);
+	return _parent;
+}
+
+node_ptr html::parser::parse_parallel(const std::string& html, unsigned threads) {
+	const size_t min_chunk = 256 * 1024;
+	threads = pool_size(threads, html.size() / min_chunk);
+	if(threads < 2) {
+		return parse(html);
+	}
+	reset();
+	const char* data = keep_source(html.data(), html.data() + html.size());
+	// Chunks start right before a start tag: if the tokenizer is in the data state when it
+	// reaches such a boundary, the next chunk tokenizes exactly as if it started from scratch
+	size_t chunks = std::min<size_t>(threads * 4, html.size() / min_chunk);
+	std::vector<size_t> bounds(1, 0);
+	for(size_t i = 1; i < chunks; i++) {
+		size_t pos = std::max(html.size() * i / chunks, bounds.back() + 1);
+		while((pos = html.find('<', pos)) != std::string::npos && (pos + 1 == html.size() || !utils::is_alpha(html[pos + 1]))) {
+			pos++;
+		}
+		if(pos == std::string::npos) {
+			break;
+		}
+		bounds.push_back(pos);
+	}
+	bounds.push_back(html.size());
+	chunks = bounds.size() - 1;
+	struct chunk {
+		parser p;
+		node root;
+		std::vector<node_ptr> tokens;
+	};
+	std::vector<chunk> parts(chunks);
+	auto tokenize_chunk = [&](chunk& part, size_t i) {
+		part.p.tokenize_block(data + bounds[i], data + bounds[i + 1], bounds[i]);
+	};
+	for(auto& part : parts) {
+		part.p.options = options;
+		part.p.reset();
+		part.p.attributes_kept = attributes_kept;
+		part.p.tokens = &part.tokens;
+		part.p.current_ptr = &part.root;
+		part.p.next_token();
+		part.p.token_begin = bounds[&part - &parts[0]];
+		part.p.watched = watched;
+		part.p.deadline = deadline;
+	}
+	work_pool(chunks, threads).run([&](unsigned, size_t i) {
+		tokenize_chunk(parts[i], i);
+	});
+	auto _parent = utils::make_unique<node>();
+	current_ptr = _parent.get();
+	size_t end = html.size();
+	for(size_t i = 0; i < chunks;) {
+		chunk& part = parts[i++];
+		if(part.p.stopped) {
+			// the chunk ran out of time, report it from this parser
+			if(!check_deadline()) {
+				stopped = true;
+			}
+			break;
+		}
+		// a chunk that ends inside a tag, comment or rawtext invalidates the guess for the next one,
+		// so the tokenizer carries on over it and its speculative tokens are thrown away
+		while(i < chunks && part.p.state != state_t::data) {
+			parts[i].tokens.clear();
+			tokenize_chunk(part, i++);
+		}
+		part.p.new_node->type_node = node_t::text;
+		part.p.tag_begin = bounds[i];
+		part.p.handle_node();
+		for(auto& token : part.tokens) {
+			size_t token_end = token->source_end;
+			insert_node(token);
+			if(stopped) {
+				end = token_end;
+				break;
+			}
+		}
+		part.tokens.clear();
+		if(stopped) {
+			break;
+		}
+	}
+	if(skimming) {
+		end_skim(end);
+	}
+	close_elements(end);
+	return _parent;
 }
 
 template<class InputIt>
 node_ptr html::parser::parse(InputIt it, InputIt end) {
-	char c = 0;
-	bool reconsume = false;
-	state = state_t::data;
+	reset();
 	auto _parent = utils::make_unique<node>();
 	current_ptr = _parent.get();
-	new_node = utils::make_unique<node>(current_ptr);
-	new_node->type_node = node_t::text;
-	std::string k;
-	while(it != end) {
+	next_token();
+	tokenize(it, end);
+	finish(0);
+	return _parent;
+}
+
+template<class InputIt>
+InputIt html::parser::tokenize(InputIt it, InputIt end, bool last) {
+	char c = 0;
+	bool reconsume = false;
+	size_t text_max = options.max_text;
+	size_t value_max = options.max_attribute_length;
+	// attributes that are filtered or limited are read while parsing, so that the options apply to them
+	lazy = options.lazy_attributes && std::is_same<InputIt, const char*>::value && attributes_kept.empty() && !options.max_attributes && !value_max;
+	if(state >= state_t::before_attribute_name && state <= state_t::self_closing) {
+		capture_from(it);
+	}
+	while(it != end && !stopped) {
 		c = *it;
 		switch(state) {
 			case state_t::data: // 0
 				if(c == '<') {
+					tag_begin = position(it);
 					state = state_t::tag_open;
+				} else if(skimming) {
+					skip_until(it, end, '<');
 				} else {
-					new_node->content += c;
+					append_until(it, end, '<', new_node->content, text_max);
 				}
 			break;
 			case state_t::rawtext: // 3
 				if(c == '<') {
+					tag_begin = position(it);
 					state = state_t::rawtext_less_than_sign;
+				} else if(skip_rawtext) {
+					skip_until(it, end, '<');
 				} else if(c == 0x00) {
-					new_node->content += '_';
+					put(new_node->content, '_', text_max);
 				} else {
-					new_node->content += c;
+					append_until(it, end, '<', 0x00, new_node->content, text_max);
 				}
 			break;
 			case state_t::tag_open: // 6
@@ -670,17 +3018,17 @@ node_ptr html::parser::parse(InputIt it, InputIt end) {
 					state = state_t::end_tag_open;
 				} else if(utils::is_alpha(c)) {
 					state = state_t::tag_name;
-					handle_node();
+					handle_node(it);
 					new_node->type_node = node_t::tag;
 					new_node->type_tag = tag_t::open;
 					reconsume = true;
 				} else if(c == '?') {
 					state = state_t::bogus_comment;
-					handle_node();
+					handle_node(it);
 					new_node->type_node = node_t::comment;
 					reconsume = true;
 				} else {
-					new_node->content += '<';
+					put(new_node->content, '<', text_max);
 					reconsume = true;
 					state = state_t::data;
 				}
@@ -688,7 +3036,7 @@ node_ptr html::parser::parse(InputIt it, InputIt end) {
 			case state_t::end_tag_open: // 7
 				if(utils::is_alpha(c)) {
 					state = state_t::tag_name;
-					handle_node();
+					handle_node(it);
 					new_node->type_node = node_t::tag;
 					new_node->type_tag = tag_t::close;
 					reconsume = true;
@@ -696,7 +3044,7 @@ node_ptr html::parser::parse(InputIt it, InputIt end) {
 					state = state_t::data;
 				} else {
 					state = state_t::bogus_comment;
-					handle_node();
+					handle_node(it);
 					new_node->type_node = node_t::comment;
 					reconsume = true;
 				}
@@ -704,11 +3052,13 @@ node_ptr html::parser::parse(InputIt it, InputIt end) {
 			case state_t::tag_name: // 8
 				if(utils::is_space(c)) {
 					state = state_t::before_attribute_name;
+					capture_from(it);
 				} else if(c == '/') {
 					state = state_t::self_closing;
+					capture_from(it);
 				} else if(c == '>') {
 					state = state_t::data;
-					handle_node();
+					handle_node(it);
 				} else if(utils::is_uppercase_alpha(c)) {
 					new_node->tag_name += std::tolower(c);
 				} else if(c == 0x00) {
@@ -721,7 +3071,9 @@ node_ptr html::parser::parse(InputIt it, InputIt end) {
 				if(c == '/') {
 					state = state_t::rawtext_end_tag_open;
 				} else {
-					new_node->content += '<';
+					if(!skip_rawtext) {
+						put(new_node->content, '<', text_max);
+					}
 					reconsume = true;
 					state = state_t::rawtext;
 				}
@@ -733,8 +3085,10 @@ node_ptr html::parser::parse(InputIt it, InputIt end) {
 					reconsume = true;
 					state = state_t::rawtext_end_tag_name;
 				} else {
-					new_node->content += '<';
-					new_node->content += '/';
+					if(!skip_rawtext) {
+						put(new_node->content, '<', text_max);
+						put(new_node->content, '/', text_max);
+					}
 					reconsume = true;
 					state = state_t::rawtext;
 				}
@@ -754,7 +3108,7 @@ node_ptr html::parser::parse(InputIt it, InputIt end) {
 				} else if(c == '>') {
 					if(new_node->tag_name == current_ptr->tag_name) {
 						state = state_t::data;
-						handle_node();
+						handle_node(it);
 						anything_else = false;
 					}
 				} else if(utils::is_uppercase_alpha(c)) {
@@ -765,9 +3119,11 @@ node_ptr html::parser::parse(InputIt it, InputIt end) {
 					anything_else = false;
 				}
 				if(anything_else) {
-					new_node->content += '<';
-					new_node->content += '/';
-					new_node->content += new_node->tag_name;
+					if(!skip_rawtext) {
+						put(new_node->content, '<', text_max);
+						put(new_node->content, '/', text_max);
+						new_node->content.append(new_node->tag_name, 0, room(new_node->content, text_max));
+					}
 					new_node->tag_name.clear();
 					reconsume = true;
 					state = state_t::rawtext;
@@ -781,28 +3137,28 @@ node_ptr html::parser::parse(InputIt it, InputIt end) {
 					reconsume = true;
 					state = state_t::after_attribute_name;
 				} else if(c == '=') {
-					k = c;
+					key = c;
 					state = state_t::attribute_name;
 				} else {
-					k.clear();
+					key.clear();
 					reconsume = true;
 					state = state_t::attribute_name;
 				}
 			break;
 			case state_t::attribute_name: // 33
 				if(utils::is_space(c) || c == '/' || c == '>') {
-					new_node->attributes[k];
+					store_attribute();
 					reconsume = true;
 					state = state_t::after_attribute_name;
 				} else if(c == '=') {
-					new_node->attributes[k];
+					store_attribute();
 					state = state_t::before_attribute_value;
 				} else if(c == 0x00) {
-					k += '_';
+					key += '_';
 				} else if(c == '\'' || c == '"' || c == '<') {
-					k += c;
+					key += c;
 				} else {
-					k += std::tolower(c);
+					key += std::tolower(c);
 				}
 			break;
 			case state_t::after_attribute_name: // 34
@@ -813,10 +3169,11 @@ node_ptr html::parser::parse(InputIt it, InputIt end) {
 				} else if(c == '=') {
 					state = state_t::before_attribute_value;
 				} else if(c == '>') {
+					capture_to(it);
 					state = state_t::data;
-					handle_node();
+					handle_node(it);
 				} else {
-					k.clear();
+					key.clear();
 					reconsume = true;
 					state = state_t::attribute_name;
 				}
@@ -829,8 +3186,9 @@ node_ptr html::parser::parse(InputIt it, InputIt end) {
 				} else if(c == '\'') {
 					state = state_t::attribute_value_single;
 				} else if(c == '>') {
+					capture_to(it);
 					state = state_t::data;
-					handle_node();
+					handle_node(it);
 				} else {
 					reconsume = true;
 					state = state_t::attribute_value_unquoted;
@@ -839,33 +3197,40 @@ node_ptr html::parser::parse(InputIt it, InputIt end) {
 			case state_t::attribute_value_double: // 36
 				if(c == '"') {
 					state = state_t::after_attribute_value_quoted;
+				} else if(!attr_value) {
+					skip_until(it, end, '"');
 				} else if(c == 0x00) {
-					new_node->attributes[k] += '_';
+					put(*attr_value, '_', value_max);
 				} else {
-					new_node->attributes[k] += c;
+					append_until(it, end, '"', 0x00, *attr_value, value_max);
 				}
 			break;
 			case state_t::attribute_value_single: // 37
 				if(c == '\'') {
 					state = state_t::after_attribute_value_quoted;
+				} else if(!attr_value) {
+					skip_until(it, end, '\'');
 				} else if(c == 0x00) {
-					new_node->attributes[k] += '_';
+					put(*attr_value, '_', value_max);
 				} else {
-					new_node->attributes[k] += c;
+					append_until(it, end, '\'', 0x00, *attr_value, value_max);
 				}
 			break;
 			case state_t::attribute_value_unquoted: // 38
 				if(utils::is_space(c)) {
 					state = state_t::before_attribute_name;
 				} else if(c == '>') {
+					capture_to(it);
 					state = state_t::data;
-					handle_node();
+					handle_node(it);
+				} else if(!attr_value) {
+					// skip
 				} else if(c == 0x00) {
-					new_node->attributes[k] += '_';
+					put(*attr_value, '_', value_max);
 				} else if(c == '"' || c == '\'' || c == '<' || c == '=' || c == '`') {
-					new_node->attributes[k] += c;
+					put(*attr_value, c, value_max);
 				} else {
-					new_node->attributes[k] += c;
+					put(*attr_value, c, value_max);
 				}
 			break;
 			case state_t::after_attribute_value_quoted: // 39
@@ -874,8 +3239,9 @@ node_ptr html::parser::parse(InputIt it, InputIt end) {
 				} else if(c == '/') {
 					state = state_t::self_closing;
 				} else if(c == '>') {
+					capture_to(it);
 					state = state_t::data;
-					handle_node();
+					handle_node(it);
 				} else {
 					reconsume = true;
 					state = state_t::before_attribute_name;
@@ -883,9 +3249,10 @@ node_ptr html::parser::parse(InputIt it, InputIt end) {
 			break;
 			case state_t::self_closing: // 40
 				if(c == '>') {
+					capture_to(it);
 					new_node->self_closing = true;
 					state = state_t::data;
-					handle_node();
+					handle_node(it);
 				} else {
 					reconsume = true;
 					state = state_t::before_attribute_name;
@@ -894,32 +3261,37 @@ node_ptr html::parser::parse(InputIt it, InputIt end) {
 			case state_t::bogus_comment: // 41
 				if(c == '>') {
 					state = state_t::data;
-					handle_node();
+					handle_node(it);
 				} else if(c == 0x00) {
-					new_node->content += '_';
+					put(new_node->content, '_', text_max);
 				} else {
-					new_node->content += c;
+					append_until(it, end, '>', 0x00, new_node->content, text_max);
 				}
 			break;
 			case state_t::markup_dec_open_state: // 42
+				if(!last && short_of(it, end, 7)) {
+					// not enough input to look ahead, wait for the next block
+					capture_to(it);
+					return it;
+				}
 				if(utils::ilook_ahead(it, end, "--")) {
 					std::advance(it, 2);
 					state = state_t::comment_start;
-					handle_node();
+					handle_node(it);
 					new_node->type_node = node_t::comment;
 					reconsume = true;
 				} else if(utils::ilook_ahead(it, end, "DOCTYPE")) {
 					std::advance(it, 7);
 					state = state_t::before_doctype_name;
-					handle_node();
+					handle_node(it);
 					new_node->type_node = node_t::doctype;
 					reconsume = true;
 				} else {
 					state = state_t::bogus_comment;
-					handle_node();
+					handle_node(it);
 					new_node->type_node = node_t::comment;
 					new_node->bogus_comment = true;
-					new_node->content += c;
+					put(new_node->content, c, text_max);
 				}
 			break;
 			case state_t::comment_start: // 43
@@ -927,7 +3299,7 @@ node_ptr html::parser::parse(InputIt it, InputIt end) {
 					state = state_t::comment_start_dash;
 				} else if(c == '>') {
 					state = state_t::data;
-					handle_node();
+					handle_node(it);
 				} else {
 					reconsume = true;
 					state = state_t::comment;
@@ -938,9 +3310,9 @@ node_ptr html::parser::parse(InputIt it, InputIt end) {
 					state = state_t::comment_end;
 				} else if(c == '>') {
 					state = state_t::data;
-					handle_node();
+					handle_node(it);
 				} else {
-					new_node->content += '-';
+					put(new_node->content, '-', text_max);
 					state = state_t::comment;
 				}
 			break;
@@ -948,28 +3320,28 @@ node_ptr html::parser::parse(InputIt it, InputIt end) {
 				if(c == '-') {
 					state = state_t::comment_end_dash;
 				} else if(c == 0x00) {
-					new_node->content += '_';
+					put(new_node->content, '_', text_max);
 				} else {
-					new_node->content += c;
+					append_until(it, end, '-', 0x00, new_node->content, text_max);
 				}
 			break;
 			case state_t::comment_end_dash: // 50
 				if(c == '-') {
 					state = state_t::comment_end;
 				} else {
-					new_node->content += '-';
+					put(new_node->content, '-', text_max);
 					state = state_t::comment;
 				}
 			break;
 			case state_t::comment_end: // 51
 				if(c == '>') {
 					state = state_t::data;
-					handle_node();
+					handle_node(it);
 				} else if(c == '-') {
-					new_node->content += c;
+					put(new_node->content, c, text_max);
 				} else {
-					new_node->content += '-';
-					new_node->content += '-';
+					put(new_node->content, '-', text_max);
+					put(new_node->content, '-', text_max);
 					reconsume = true;
 					state = state_t::comment;
 				}
@@ -979,23 +3351,23 @@ node_ptr html::parser::parse(InputIt it, InputIt end) {
 					// skip
 				} else if(c == '>') {
 					state = state_t::data;
-					handle_node();
+					handle_node(it);
 				} else if(c == 0x00) {
-					new_node->content += '_';
+					put(new_node->content, '_', text_max);
 					state = state_t::doctype_name;
 				} else {
-					new_node->content += c;
+					put(new_node->content, c, text_max);
 					state = state_t::doctype_name;
 				}
 			break;
 			case state_t::doctype_name: // 55
 				if(c == '>') {
 					state = state_t::data;
-					handle_node();
+					handle_node(it);
 				} else if(c == 0x00) {
-					new_node->content += '_';
+					put(new_node->content, '_', text_max);
 				} else {
-					new_node->content += c;
+					append_until(it, end, '>', 0x00, new_node->content, text_max);
 				}
 			break;
 		}
@@ -1005,9 +3377,339 @@ node_ptr html::parser::parse(InputIt it, InputIt end) {
 			reconsume = false;
 		}
 	}
-	new_node->type_node = node_t::text;
-	handle_node();
-	return _parent;
+	capture_to(it);
+	return it;
+}
+
+template node_ptr parser::parse(std::string::const_iterator, std::string::const_iterator);
+template node_ptr parser::parse(std::istreambuf_iterator<char>, std::istreambuf_iterator<char>);
+
+void parse_batch(const std::vector<std::string>& inputs, std::function<void(size_t, node_ptr)> sink, const parser& proto, unsigned threads) {
+	if(inputs.empty()) {
+		return;
+	}
+	threads = pool_size(threads, inputs.size());
+	std::vector<parser> parsers(threads, proto);
+	std::mutex sink_lock;
+	work_pool(inputs.size(), threads).run([&](unsigned w, size_t i) {
+		node_ptr doc = parsers[w].parse(inputs[i]);
+		std::lock_guard<std::mutex> lock(sink_lock);
+		sink(i, std::move(doc));
+	});
+}
+
+std::vector<node_ptr> parse_batch(const std::vector<std::string>& inputs, const parser& proto, unsigned threads) {
+	std::vector<node_ptr> ret(inputs.size());
+	parse_batch(inputs, [&](size_t i, node_ptr doc) {
+		ret[i] = std::move(doc);
+	}, proto, threads);
+	return ret;
+}
+
+namespace {
+
+// Snapshot layout, native byte order: a header, then arrays starting at multiples of 8 bytes. The
+// arrays of a flat_document come first so that a mapped snapshot is read in place, then the node
+// fields that it does not keep and the names its tags and attributes refer to.
+const char snapshot_magic[8] = {'H', 'T', 'M', 'L', 'S', 'N', 'P', '2'};
+const uint32_t snapshot_order = 0x01020304;
+
+struct snapshot_header {
+	char magic[8];
+	uint32_t order;
+	uint32_t nodes;
+	uint32_t children;
+	uint32_t attributes;
+	uint32_t text;
+	uint32_t atoms;
+	uint32_t names;
+	uint32_t unused;
+};
+
+size_t snapshot_align(size_t offset) {
+	return (offset + 7) & ~size_t(7);
+}
+
+class snapshot_writer {
+public:
+	explicit snapshot_writer(const std::string& path)
+		: out(path, std::ios::binary | std::ios::trunc)
+		, path(path) {
+		if(!out) {
+			throw std::system_error(errno, std::generic_category(), path);
+		}
+	}
+	template<class T>
+	void write(const T* data, size_t count) {
+		static const char padding[8] = {};
+		out.write(padding, static_cast<std::streamsize>(snapshot_align(offset) - offset));
+		offset = snapshot_align(offset) + count * sizeof(T);
+		out.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(count * sizeof(T)));
+	}
+	void close() {
+		if(!out.flush()) {
+			throw std::system_error(errno, std::generic_category(), path);
+		}
+	}
+private:
+	std::ofstream out;
+	std::string path;
+	size_t offset = 0;
+};
+
+// Arrays of a mapped snapshot, checked once so that no handle or range points outside of them
+class snapshot_file {
+public:
+	explicit snapshot_file(const std::string& path);
+	std::string name(uint32_t atom) const {
+		return std::string(names + atom_begin[atom], atom_begin[atom + 1] - atom_begin[atom]);
+	}
+	snapshot_header header;
+	const uint8_t* types;
+	const uint8_t* self_closed;
+	const uint8_t* type_tags;
+	const uint8_t* bogus_comments;
+	const uint32_t* tags;
+	const uint32_t* parents;
+	const uint32_t* first_children;
+	const uint32_t* next_siblings;
+	const uint32_t* ends;
+	const uint32_t* text_begin;
+	const uint32_t* text_size;
+	const uint32_t* indices;
+	const uint32_t* element_counts;
+	const uint32_t* child_begin;
+	const uint32_t* children;
+	const uint32_t* attr_begin;
+	const uint32_t* attr_names;
+	const uint32_t* attr_value_begin;
+	const uint32_t* attr_value_size;
+	const uint32_t* atom_begin;
+	const uint64_t* source_begin;
+	const uint64_t* source_end;
+	const char* text;
+	const char* names;
+private:
+	template<class T>
+	const T* section(size_t count) {
+		offset = snapshot_align(offset);
+		if(offset > file.size || count > (file.size - offset) / sizeof(T)) {
+			throw std::runtime_error("not a snapshot: " + path);
+		}
+		const char* ret = file.data + offset;
+		offset += count * sizeof(T);
+		return reinterpret_cast<const T*>(ret);
+	}
+	std::string path;
+	file_map file;
+	size_t offset = 0;
+};
+
+snapshot_file::snapshot_file(const std::string& path)
+	: path(path)
+	, file(path, false) {
+	if(file.size < sizeof(header)) {
+		throw std::runtime_error("not a snapshot: " + path);
+	}
+	std::memcpy(&header, file.data, sizeof(header));
+	offset = sizeof(header);
+	if(std::memcmp(header.magic, snapshot_magic, sizeof(header.magic)) || header.order != snapshot_order || !header.nodes || !header.atoms) {
+		throw std::runtime_error("not a snapshot: " + path);
+	}
+	size_t n = header.nodes;
+	size_t a = header.attributes;
+	// in the order save_snapshot writes them
+	types = section<uint8_t>(n);
+	self_closed = section<uint8_t>(n);
+	type_tags = section<uint8_t>(n);
+	bogus_comments = section<uint8_t>(n);
+	tags = section<uint32_t>(n);
+	parents = section<uint32_t>(n);
+	first_children = section<uint32_t>(n);
+	next_siblings = section<uint32_t>(n);
+	ends = section<uint32_t>(n);
+	text_begin = section<uint32_t>(n);
+	text_size = section<uint32_t>(n);
+	indices = section<uint32_t>(n);
+	element_counts = section<uint32_t>(n);
+	child_begin = section<uint32_t>(n + 1);
+	children = section<uint32_t>(header.children);
+	attr_begin = section<uint32_t>(n + 1);
+	attr_names = section<uint32_t>(a);
+	attr_value_begin = section<uint32_t>(a);
+	attr_value_size = section<uint32_t>(a);
+	atom_begin = section<uint32_t>(header.atoms + size_t(1));
+	source_begin = section<uint64_t>(n);
+	source_end = section<uint64_t>(n);
+	text = section<char>(header.text);
+	names = section<char>(header.names);
+	if(offset != file.size) {
+		throw std::runtime_error("not a snapshot: " + path);
+	}
+	auto in_text = [this](uint32_t begin, uint32_t size) {
+		return uint64_t(begin) + size <= header.text;
+	};
+	bool valid = child_begin[n] == header.children && attr_begin[n] == header.attributes && atom_begin[header.atoms] == header.names &&
+		parents[0] == flat_document::npos;
+	for(size_t h = 0; valid && h < n; h++) {
+		valid = types[h] <= static_cast<uint8_t>(node_t::doctype) && type_tags[h] <= static_cast<uint8_t>(tag_t::close) &&
+			tags[h] < header.atoms && (!h || parents[h] < h) && ends[h] > h && ends[h] <= n &&
+			(first_children[h] == flat_document::npos || (first_children[h] > h && first_children[h] < n)) &&
+			(next_siblings[h] == flat_document::npos || (next_siblings[h] > h && next_siblings[h] < n)) &&
+			in_text(text_begin[h], text_size[h]) && child_begin[h] <= child_begin[h + 1] && attr_begin[h] <= attr_begin[h + 1];
+	}
+	for(size_t i = 0; valid && i < header.children; i++) {
+		valid = children[i] < n;
+	}
+	for(size_t i = 0; valid && i < a; i++) {
+		valid = attr_names[i] < header.atoms && in_text(attr_value_begin[i], attr_value_size[i]);
+	}
+	for(size_t i = 0; valid && i < header.atoms; i++) {
+		valid = atom_begin[i] <= atom_begin[i + 1];
+	}
+	if(!valid) {
+		throw std::runtime_error("broken snapshot: " + path);
+	}
+}
+
+}
+
+void save_snapshot(const node& root, const std::string& path) {
+	flat_document doc(root);
+	// node fields that a flat document does not keep, in the same order
+	std::vector<uint8_t> type_tags;
+	std::vector<uint8_t> bogus_comments;
+	std::vector<uint64_t> source_begin;
+	std::vector<uint64_t> source_end;
+	auto add = [&](const node& n) {
+		type_tags.push_back(static_cast<uint8_t>(n.type_tag));
+		bogus_comments.push_back(n.bogus_comment);
+		source_begin.push_back(n.source_begin);
+		source_end.push_back(n.source_end);
+	};
+	add(root);
+	root.visit([&add](const node& n) {
+		add(n);
+		return visit_t::next;
+	}, [](const node&) {
+		return visit_t::next;
+	});
+	std::vector<uint32_t> atom_begin;
+	std::string names;
+	for(auto& name : doc.atoms) {
+		atom_begin.push_back(static_cast<uint32_t>(names.size()));
+		names += name;
+	}
+	if(names.size() > UINT32_MAX) {
+		throw std::length_error("snapshot string table exceeds 4 GiB");
+	}
+	atom_begin.push_back(static_cast<uint32_t>(names.size()));
+	snapshot_header header = {};
+	std::memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+	header.order = snapshot_order;
+	header.nodes = static_cast<uint32_t>(doc.size());
+	header.children = static_cast<uint32_t>(doc.children.size());
+	header.attributes = static_cast<uint32_t>(doc.attr_names.size());
+	header.text = static_cast<uint32_t>(doc.text.size());
+	header.atoms = static_cast<uint32_t>(doc.atoms.size());
+	header.names = static_cast<uint32_t>(names.size());
+	snapshot_writer out(path);
+	out.write(&header, 1);
+	out.write(doc.types.data(), doc.types.size());
+	out.write(doc.self_closed.data(), doc.self_closed.size());
+	out.write(type_tags.data(), type_tags.size());
+	out.write(bogus_comments.data(), bogus_comments.size());
+	out.write(doc.tags.data(), doc.tags.size());
+	out.write(doc.parents.data(), doc.parents.size());
+	out.write(doc.first_children.data(), doc.first_children.size());
+	out.write(doc.next_siblings.data(), doc.next_siblings.size());
+	out.write(doc.ends.data(), doc.ends.size());
+	out.write(doc.text_begin.data(), doc.text_begin.size());
+	out.write(doc.text_size.data(), doc.text_size.size());
+	out.write(doc.indices.data(), doc.indices.size());
+	out.write(doc.element_counts.data(), doc.element_counts.size());
+	out.write(doc.child_begin.data(), doc.child_begin.size());
+	out.write(doc.children.data(), doc.children.size());
+	out.write(doc.attr_begin.data(), doc.attr_begin.size());
+	out.write(doc.attr_names.data(), doc.attr_names.size());
+	out.write(doc.attr_value_begin.data(), doc.attr_value_begin.size());
+	out.write(doc.attr_value_size.data(), doc.attr_value_size.size());
+	out.write(atom_begin.data(), atom_begin.size());
+	out.write(source_begin.data(), source_begin.size());
+	out.write(source_end.data(), source_end.size());
+	out.write(doc.text.data(), doc.text.size());
+	out.write(names.data(), names.size());
+	out.close();
+}
+
+node_ptr load_snapshot(const std::string& path) {
+	snapshot_file file(path);
+	node_ptr root;
+	// parents come before their children
+	std::vector<node*> nodes(file.header.nodes);
+	std::string key;
+	for(uint32_t h = 0; h < file.header.nodes; h++) {
+		auto n = utils::make_unique<node>();
+		n->type_node = static_cast<node_t>(file.types[h]);
+		n->type_tag = static_cast<tag_t>(file.type_tags[h]);
+		n->self_closing = file.self_closed[h] != 0;
+		n->bogus_comment = file.bogus_comments[h] != 0;
+		n->tag_name = file.name(file.tags[h]);
+		n->content.assign(file.text + file.text_begin[h], file.text_size[h]);
+		n->source_begin = static_cast<size_t>(file.source_begin[h]);
+		n->source_end = static_cast<size_t>(file.source_end[h]);
+		for(uint32_t a = file.attr_begin[h]; a < file.attr_begin[h + 1]; a++) {
+			key = file.name(file.attr_names[a]);
+			n->attributes[key].assign(file.text + file.attr_value_begin[a], file.attr_value_size[a]);
+		}
+		n->children.reserve(file.child_begin[h + 1] - file.child_begin[h]);
+		nodes[h] = n.get();
+		if(!h) {
+			root = std::move(n);
+			continue;
+		}
+		node* parent = nodes[file.parents[h]];
+		n->parent = parent;
+		if(n->type_node == node_t::tag) {
+			n->index = parent->node_count++;
+		}
+		parent->children.push_back(std::move(n));
+	}
+	return root;
+}
+
+flat_document map_snapshot(const std::string& path) {
+	auto file = std::make_shared<snapshot_file>(path);
+	const snapshot_file& f = *file;
+	size_t n = f.header.nodes;
+	size_t a = f.header.attributes;
+	using handle = flat_document::handle;
+	flat_document doc;
+	doc.types = flat_document::column<uint8_t>(f.types, n);
+	doc.self_closed = flat_document::column<uint8_t>(f.self_closed, n);
+	doc.tags = flat_document::column<uint32_t>(f.tags, n);
+	doc.parents = flat_document::column<handle>(f.parents, n);
+	doc.first_children = flat_document::column<handle>(f.first_children, n);
+	doc.next_siblings = flat_document::column<handle>(f.next_siblings, n);
+	doc.ends = flat_document::column<handle>(f.ends, n);
+	doc.text_begin = flat_document::column<uint32_t>(f.text_begin, n);
+	doc.text_size = flat_document::column<uint32_t>(f.text_size, n);
+	doc.child_begin = flat_document::column<uint32_t>(f.child_begin, n + 1);
+	doc.children = flat_document::column<handle>(f.children, f.header.children);
+	doc.indices = flat_document::column<uint32_t>(f.indices, n);
+	doc.element_counts = flat_document::column<uint32_t>(f.element_counts, n);
+	doc.attr_begin = flat_document::column<uint32_t>(f.attr_begin, n + 1);
+	doc.attr_names = flat_document::column<uint32_t>(f.attr_names, a);
+	doc.attr_value_begin = flat_document::column<uint32_t>(f.attr_value_begin, a);
+	doc.attr_value_size = flat_document::column<uint32_t>(f.attr_value_size, a);
+	doc.text = flat_document::column<char>(f.text, f.header.text);
+	// only the names are copied, once per distinct name
+	doc.atoms.reserve(f.header.atoms);
+	for(uint32_t i = 0; i < f.header.atoms; i++) {
+		doc.atoms.push_back(f.name(i));
+	}
+	doc.storage = std::move(file);
+	return doc;
 }
 
 node utils::make_node(node_t type, const std::string& str, const std::map<std::string, std::string>& attributes) {
@@ -1028,13 +3730,7 @@ node utils::make_node(node_t type, const std::string& str, const std::map<std::s
 }
 
 inline bool utils::contains_word(const std::string& str, const std::string& word) {
-	auto pos = str.find(word);
-	if(pos == std::string::npos) {
-		return false;
-	}
-	bool start = pos < 1 || is_space(str[pos - 1]);
-	bool end = pos + word.size() >= str.size() || is_space(str[pos + word.size()]);
-	return start && end;
+	return ::html::contains_word(text_ref{str.data(), str.size()}, word);
 }
 
 template<class InputIt>
@@ -1047,6 +3743,26 @@ inline bool utils::ilook_ahead(InputIt it, InputIt end, const std::string& str)
 	return true;
 }
 
+std::function<void(const char*, size_t)> utils::fd_sink(int fd) {
+	return [fd](const char* data, size_t size) {
+		while(size) {
+#ifdef _WIN32
+			int n = ::_write(fd, data, static_cast<unsigned>(size));
+#else
+			ssize_t n = ::write(fd, data, size);
+			if(n < 0 && errno == EINTR) {
+				continue;
+			}
+#endif
+			if(n < 0) {
+				throw std::system_error(errno, std::generic_category(), "write");
+			}
+			data += n;
+			size -= static_cast<size_t>(n);
+		}
+	};
+}
+
 std::string utils::replace_any_copy(const std::string& subject, const std::string& search, const std::string& replace) {
     size_t pos = 0, prev = 0;
     std::string ret;
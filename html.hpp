@@ -10,17 +10,34 @@
 #include <cctype>
 #include <algorithm>
 #include <map>
+#include <list>
+#include <unordered_map>
+#include <cstdint>
 #include <utility>
 #include <iterator>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
 
 namespace html {
 
 	class selector;
 	class parser;
+	class string_pool;
 	class node;
+	class serializer;
+	class flat_document;
+	struct parse_options;
 
 	using node_ptr = std::unique_ptr<node>;
 
+	std::vector<std::pair<const node*, const node*>> diff(const node&, const node&);
+	node_ptr clone(const std::shared_ptr<const node>&);
+	void save_snapshot(const node&, const std::string& path);
+	node_ptr load_snapshot(const std::string& path);
+	flat_document map_snapshot(const std::string& path);
+
 	enum class node_t {
 		none,
 		text,
@@ -36,7 +53,33 @@ namespace html {
 	};
 
 	enum class err_t {
-		tag_not_closed
+		tag_not_closed,
+		too_deep,
+		too_many_nodes,
+		too_many_attributes,
+		attribute_too_long,
+		text_too_long,
+		timeout,
+		cancelled
+	};
+
+	enum class prune_t {
+		none,
+		children,
+		element
+	};
+
+	enum class visit_t {
+		next,
+		skip,
+		stop
+	};
+
+	struct text_options {
+		bool collapse = true;
+		bool skip_rawtext = true;
+		std::string separator = "\n";
+		std::function<void(const node&, size_t)> on_text;
 	};
 
 	class node {
@@ -51,54 +94,109 @@ namespace html {
 		, content(std::move(d.content))
 		, parent(nullptr)
 		, bogus_comment(d.bogus_comment)
+		, hashed(d.hashed)
+		, stale(d.stale)
+		, holes(d.holes)
+		, slotted(d.slotted)
 		, children(std::move(d.children))
 		, attributes(std::move(d.attributes))
 		, index(0)
-		, node_count(d.node_count) {}
+		, node_count(d.node_count)
+		, source_begin(d.source_begin)
+		, source_end(d.source_end)
+		, hash(d.hash)
+		, side(std::move(d.side)) {
+			for(auto& c : children) {
+				if(c) {
+					c->parent = this;
+				}
+			}
+		}
+		~node();
 		node* at(size_t i) const {
-			if(i < children.size()) {
-				return children[i].get();
+			auto& children = child_nodes();
+			if(holes) {
+				return nth(i);
 			}
-			return nullptr;
+			return i < children.size() ? children[i].get() : nullptr;
 		}
 		size_t size() const {
-			return children.size();
+			auto& children = child_nodes();
+			return holes ? count() : children.size();
 		}
 		bool empty() const {
-			return children.empty();
+			return size() == 0;
 		}
 		std::vector<node_ptr>::iterator begin() {
-			return children.begin();
+			return child_nodes().begin();
 		}
 		std::vector<node_ptr>::iterator end() {
-			return children.end();
+			return child_nodes().end();
 		}
 		std::vector<node_ptr>::const_iterator begin() const {
-			return children.begin();
+			return child_nodes().begin();
 		}
 		std::vector<node_ptr>::const_iterator end() const {
-			return children.end();
+			return child_nodes().end();
 		}
 		std::vector<node_ptr>::const_iterator cbegin() const {
-			return children.cbegin();
+			return child_nodes().cbegin();
 		}
 		std::vector<node_ptr>::const_iterator cend() const {
-			return children.cend();
+			return child_nodes().cend();
 		}
 		std::vector<node*> select(const selector, bool nested = true);
 		std::string to_html(char indent = '	', bool child = true, bool text = true) const;
+		void to_html(std::ostream&, char indent = '	', bool child = true, bool text = true) const;
+		void to_html(std::function<void(const char*, size_t)>, char indent = '	', bool child = true, bool text = true) const;
 		std::string to_raw_html(bool child = true, bool text = true) const;
+		void to_raw_html(std::ostream&, bool child = true, bool text = true) const;
+		void to_raw_html(std::function<void(const char*, size_t)>, bool child = true, bool text = true) const;
+		std::string to_minified_html() const;
+		void to_minified_html(std::ostream&) const;
+		void to_minified_html(std::function<void(const char*, size_t)>) const;
 		std::string to_text(bool raw = false) const;
+		std::string to_text(const text_options&) const;
+		void to_text(std::function<void(const char*, size_t)>, const text_options& = text_options()) const;
 		node* get_parent() const {
 			return parent;
 		}
+		std::pair<size_t, size_t> source_range() const {
+			return std::make_pair(source_begin, source_end);
+		}
+		std::string source_html(const std::string&) const;
 		bool has_attr(const std::string&) const;
 		std::string get_attr(const std::string&) const;
 		void set_attr(const std::string&, const std::string&);
 		void set_attr(const std::map<std::string, std::string>& attributes);
 		void del_attr(const std::string&);
 		node& append(const node&);
-		void walk(std::function<bool(node&)>);
+		node& append(node&&);
+		node& append(node_ptr);
+		node& adopt(node&);
+		node& splice(node&);
+		node& insert_before(const node&);
+		node& insert_before(node&&);
+		node& insert_before(node_ptr);
+		node_ptr replace_with(const node&);
+		node_ptr replace_with(node&&);
+		node_ptr replace_with(node_ptr);
+		node_ptr detach();
+		void remove();
+		uint64_t subtree_hash() const;
+		void invalidate_hash();
+		template<class F>
+		void walk(F&&);
+		template<class F>
+		void walk(F&&) const;
+		template<class F>
+		bool visit(F&&);
+		template<class F>
+		bool visit(F&&) const;
+		template<class Pre, class Post>
+		bool visit(Pre&&, Post&&);
+		template<class Pre, class Post>
+		bool visit(Pre&&, Post&&) const;
 		node_t type_node = node_t::none;
 		tag_t type_tag = tag_t::none;
 		bool self_closing = false;
@@ -107,19 +205,259 @@ namespace html {
 	private:
 		node* parent = nullptr;
 		bool bogus_comment = false;
-		std::vector<node_ptr> children;
-		std::map<std::string, std::string> attributes;
+		// the tokenizer left out attributes over `max_attributes`
+		bool attributes_cut = false;
+		mutable bool hashed = false;
+		// children has unnumbered nodes
+		mutable bool stale = false;
+		// children has empty slots, left by removed nodes
+		mutable bool holes = false;
+		// slot of every child is a lower bound of its position
+		mutable bool slotted = false;
+		struct lazy_children {
+			std::shared_ptr<const std::string> source;
+			std::shared_ptr<const parse_options> options;
+			size_t begin;
+			size_t end;
+			// or a node of a shared document whose children are copied
+			std::shared_ptr<const node> shared_root;
+			const node* shared;
+		};
+		struct pooled_attribute {
+			const std::string* name;
+			const std::string* value;
+			// values the pool does not take are kept here
+			std::string kept;
+			const std::string& get() const {
+				return value ? *value : kept;
+			}
+		};
+		// state few nodes have, kept out of the node so that the others stay small
+		struct side_state {
+			// attribute section of a lazy parse, split into attributes on first access
+			std::string raw_attributes;
+			// attributes interned in a string pool, which is kept alive while they point into it
+			std::vector<pooled_attribute> pooled;
+			std::shared_ptr<const string_pool> pool;
+			// children not built yet, when `source` or `shared` is set
+			lazy_children lazy;
+		};
+		mutable std::vector<node_ptr> children;
+		mutable std::map<std::string, std::string> attributes;
 		int index = 0;
-		int node_count = 0;
+		mutable int node_count = 0;
+		size_t source_begin = 0;
+		size_t source_end = 0;
+		mutable uint64_t hash = 0;
+		mutable size_t slot = 0;
+		mutable std::unique_ptr<side_state> side;
+		side_state& get_side() const {
+			if(!side) {
+				side.reset(new side_state());
+			}
+			return *side;
+		}
+		// the side state is released once nothing is left in it
+		void trim_side() const {
+			if(side && side->raw_attributes.empty() && side->pooled.empty() && !side->lazy.source && !side->lazy.shared) {
+				side.reset();
+			}
+		}
+		lazy_children* lazy() const {
+			return side && (side->lazy.source || side->lazy.shared) ? &side->lazy : nullptr;
+		}
+		const node* shared_node() const {
+			return side ? side->lazy.shared : nullptr;
+		}
+		bool has_pooled() const {
+			return side && !side->pooled.empty();
+		}
+		std::map<std::string, std::string>& attrs() const;
+		const std::string* find_attr(const std::string&) const;
+		size_t attr_count() const;
+		template<class F>
+		void each_attr(F) const;
+		template<class Node, class Enter, class Leave>
+		static bool descend(Node&, Enter&&, Leave&&);
+		template<class Node, class Pre, class Post>
+		static bool visit_post(Node&, Pre&&, Post&&);
+		static visit_t control(bool enter) {
+			return enter ? visit_t::next : visit_t::skip;
+		}
+		static visit_t control(visit_t v) {
+			return v;
+		}
+		std::vector<node_ptr>& child_nodes() const {
+			if(lazy()) {
+				materialize();
+			}
+			if(stale || (holes && !walking())) {
+				renumber();
+			}
+			return children;
+		}
+		// traversals running on this thread, removed children are not compacted while there are any
+		static unsigned& walking() {
+			static thread_local unsigned n = 0;
+			return n;
+		}
+		// vector borrowed from the ones kept per thread, nested users take another one;
+		// a few are kept and large ones are released so one deep document does not pin memory
+		template<class T>
+		struct scratch {
+			std::vector<T> v;
+			scratch() {
+				auto& s = spare();
+				if(!s.empty()) {
+					v = std::move(s.back());
+					s.pop_back();
+				}
+			}
+			~scratch() {
+				auto& s = spare();
+				if(s.size() < 4 && v.capacity() <= 4096) {
+					v.clear();
+					s.push_back(std::move(v));
+				}
+			}
+			static std::vector<std::vector<T>>& spare() {
+				static thread_local std::vector<std::vector<T>> s;
+				return s;
+			}
+		};
+		node* nth(size_t) const;
+		size_t count() const;
+		const std::vector<node_ptr>& nodes() const;
+		static std::vector<node_ptr>& read(node& n) {
+			return n.child_nodes();
+		}
+		static const std::vector<node_ptr>& read(const node& n) {
+			return n.nodes();
+		}
+		void materialize() const;
+		void renumber() const;
+		size_t position() const;
+		node* own(const node&);
+		static node_ptr shallow_copy(const node&, node*);
+		static void share(node&, const node*, std::shared_ptr<const node>);
 		void copy(const node*, node*);
-		void walk(node&, std::function<bool(node&)>);
-		void to_html(std::ostream&, bool, bool, int, int&, char, bool&, bool&) const;
-		void to_raw_html(std::ostream&, bool, bool) const;
-		void to_text(std::ostream&, bool&) const;
 		friend class selector;
 		friend class parser;
+		friend class serializer;
+		friend void save_snapshot(const node&, const std::string&);
+		friend node_ptr load_snapshot(const std::string&);
+		friend node_ptr clone(const std::shared_ptr<const node>&);
+		friend class flat_document;
+		friend class string_pool;
 	};
 
+	template<class F>
+	void node::walk(F&& handler) {
+		descend(*this, handler, [](node&) {});
+	}
+
+	template<class F>
+	void node::walk(F&& handler) const {
+		descend(*this, handler, [](const node&) {});
+	}
+
+	template<class F>
+	bool node::visit(F&& pre) {
+		return descend(*this, pre, [](node&) {});
+	}
+
+	template<class F>
+	bool node::visit(F&& pre) const {
+		return descend(*this, pre, [](const node&) {});
+	}
+
+	template<class Pre, class Post>
+	bool node::visit(Pre&& pre, Post&& post) {
+		return visit_post(*this, pre, post);
+	}
+
+	template<class Pre, class Post>
+	bool node::visit(Pre&& pre, Post&& post) const {
+		return visit_post(*this, pre, post);
+	}
+
+	template<class Node, class Pre, class Post>
+	bool node::visit_post(Node& root, Pre&& pre, Post&& post) {
+		// `post` may stop too, then the remaining nodes are not entered
+		bool stopped = false;
+		bool finished = descend(root, [&](Node& n) {
+			return stopped ? visit_t::stop : control(pre(n));
+		}, [&](Node& n) {
+			if(!stopped && post(n) == visit_t::stop) {
+				stopped = true;
+			}
+		});
+		return finished && !stopped;
+	}
+
+	// Depth-first traversal of the descendants of `root` with an explicit stack. `enter` returns
+	// whether the children of a node are visited, `leave` is called after them.
+	template<class Node, class Enter, class Leave>
+	bool node::descend(Node& root, Enter&& enter, Leave&& leave) {
+		struct frame {
+			Node* n;
+			const std::vector<node_ptr>* children;
+			size_t i;
+		};
+		struct lease {
+			scratch<frame> stack;
+			lease() {
+				walking()++;
+			}
+			~lease() {
+				walking()--;
+			}
+		} l;
+		auto& stack = l.stack.v;
+		// const traversals read the children of a clone from the shared document
+		stack.push_back(frame{&root, &read(root), 0});
+		while(!stack.empty()) {
+			frame& f = stack.back();
+			auto& children = *f.children;
+			if(f.i >= children.size()) {
+				Node* n = f.n;
+				stack.pop_back();
+				if(!stack.empty()) {
+					leave(*n);
+				}
+				continue;
+			}
+			Node* c = children[f.i++].get();
+			if(!c) {
+				continue;
+			}
+			visit_t v = control(enter(*c));
+			if(v == visit_t::stop) {
+				return false;
+			}
+			// `enter` may remove the node, which leaves its slot empty, or insert nodes before it
+			if(f.i > children.size() || children[f.i - 1].get() != c) {
+				size_t i = f.i;
+				while(i < children.size() && children[i].get() != c) {
+					i++;
+				}
+				if(i >= children.size()) {
+					continue;
+				}
+				f.i = i + 1;
+			}
+			if(v == visit_t::next) {
+				auto& grandchildren = read(*c);
+				if(grandchildren.empty()) {
+					leave(*c);
+				} else {
+					stack.push_back(frame{c, &grandchildren, 0});
+				}
+			}
+		}
+		return true;
+	}
+
 	class selector {
 	public:
 		selector() = default;
@@ -133,6 +471,7 @@ namespace html {
 			condition() = default;
 			condition(const condition& d) = default;
 			condition(condition&&) noexcept;
+			condition& operator=(const condition&) = default;
 			std::string tag_name;
 			std::string id;
 			std::string class_name;
@@ -141,12 +480,17 @@ namespace html {
 			std::string attr_value;
 			std::string attr_operator;
 			bool operator()(const node&) const;
+			template<class View>
+			bool match(const View&) const;
 		};
 		struct selector_matcher {
 			selector_matcher() = default;
 			selector_matcher(const selector_matcher&) = default;
 			selector_matcher(selector_matcher&&) noexcept;
+			selector_matcher& operator=(const selector_matcher&) = default;
 			bool operator()(const node&) const;
+			template<class View>
+			bool match(const View&) const;
 			bool dc_first = false;
 			bool dc_second = false;
 		private:
@@ -167,25 +511,154 @@ namespace html {
 		bool is_state_route(char c) {
 			return c == 0 || c == ' ' || c == '[' || c == ':' || c == '.' || c == '#' || c == ',' || c == '>';
 		}
+		void collect_attributes(std::unordered_set<std::string>&) const;
+		bool matches(const node&) const;
+		bool matches_above(const node&, size_t) const;
+		struct node_view;
+		struct flat_view;
 		friend class node;
+		friend class flat_document;
 		friend class parser;
+		friend struct parse_options;
+	};
+
+	class string_pool {
+	public:
+		string_pool(size_t max_values = 4096, size_t max_value_size = 32)
+			: max_values(max_values)
+			, max_value_size(max_value_size) {}
+		const std::string* intern(const std::string&);
+		size_t size() const;
+	private:
+		void intern(node&);
+		size_t max_values;
+		size_t max_value_size;
+		mutable std::mutex mutex;
+		std::unordered_set<std::string> names;
+		std::unordered_set<std::string> values;
+		friend class parser;
+	};
+
+	struct parse_options {
+		bool drop_comments = false;
+		bool drop_whitespace = false;
+		bool drop_doctype = false;
+		prune_t prune = prune_t::none;
+		std::unordered_set<std::string> prune_tags = {"script", "style", "noscript"};
+		std::unordered_set<std::string> keep_attributes;
+		bool lazy_attributes = false;
+		int skim_depth = -1;
+		selector skim_filter;
+		size_t max_depth = 0;
+		size_t max_nodes = 0;
+		size_t max_attributes = 0;
+		size_t max_attribute_length = 0;
+		size_t max_text = 0;
+		std::chrono::steady_clock::duration timeout = std::chrono::steady_clock::duration::zero();
+		const std::atomic<bool>* cancel = nullptr;
+		std::shared_ptr<string_pool> pool;
+		parse_options& keep_selector_attributes(const selector&);
 	};
 
 	class parser {
 	public:
+		parser() = default;
+		parser(const parse_options&);
+		parser(const parser&);
+		parser& set_options(const parse_options&);
+		const parse_options& get_options() const {
+			return options;
+		}
 		parser& set_callback(std::function<void(node&)> cb);
 		parser& set_callback(const selector, std::function<void(node&)> cb);
 		parser& set_callback(std::function<void(err_t, node&)> cb);
 		void clear_callbacks();
+		void reset();
+		void stop() {
+			stopped = true;
+		}
 		node_ptr parse(const std::string&);
+		node_ptr parse(const char*);
+		node_ptr parse(const char*, size_t);
+		node_ptr parse(const std::vector<char>&);
+		node_ptr parse(const char*, const char*);
+#ifdef __cpp_lib_string_view
+		node_ptr parse(std::string_view html) {
+			return parse(html.data(), html.size());
+		}
+#endif
 		node_ptr parse(std::istream&);
+		node_ptr parse_file(const std::string& path, bool sequential = true);
 		template<class InputIt>
 		node_ptr parse(InputIt, InputIt);
+		node_ptr parse_parallel(const std::string&, unsigned threads = 0);
 	private:
 		void operator()(node&);
+		bool is_pruned(const node&) const;
+		void store_attribute();
+		template<class InputIt>
+		void capture_from(InputIt) {}
+		void capture_from(const char*);
+		template<class InputIt>
+		void capture_to(InputIt) {}
+		void capture_to(const char*);
+		void update_attributes_kept();
+		template<class InputIt>
+		size_t position(InputIt) const {
+			return 0;
+		}
+		size_t position(const char* it) const {
+			return block_offset + static_cast<size_t>(it - block_begin);
+		}
+		const char* keep_source(const char*, const char*);
+		void parse_range(node&, const char*, const char*, size_t, bool closed = false);
+		const char* tokenize_block(const char*, const char*, size_t, bool last = true);
+		template<class InputIt>
+		InputIt tokenize(InputIt, InputIt, bool last = true);
+		template<class InputIt>
+		void handle_node(InputIt);
 		void handle_node();
+		void finish(size_t);
+		void next_token();
+		void insert_node(node_ptr&);
+		void skim_node(node_ptr&);
+		void report(err_t, node&);
+		bool check_limits(node_ptr&);
+		bool check_deadline();
+		void end_skim(size_t);
+		void close_elements(size_t);
+		parse_options options;
+		std::unordered_set<std::string> attributes_kept;
 		node* current_ptr = nullptr;
 		node_ptr new_node;
+		node_ptr pruned;
+		bool skip_rawtext = false;
+		bool stopped = false;
+		std::string* attr_value = nullptr;
+		bool lazy = false;
+		const char* raw_begin = nullptr;
+		std::vector<node_ptr>* tokens = nullptr;
+		std::string key;
+		const char* block_begin = nullptr;
+		size_t block_offset = 0;
+		size_t token_begin = 0;
+		size_t tag_begin = 0;
+		size_t token_end = 0;
+		int depth = 0;
+		int kept_depth = -1;
+		node* skimming = nullptr;
+		size_t skim_begin = 0;
+		std::vector<std::string> skim_stack;
+		size_t skim_size = 0;
+		std::shared_ptr<const std::string> source;
+		std::shared_ptr<const parse_options> skim_options;
+		static const size_t check_interval = 256;
+		bool limited = false;
+		bool watched = false;
+		size_t nodes = 0;
+		std::unordered_map<std::string, size_t> dropped;
+		size_t since_check = 0;
+		std::chrono::steady_clock::time_point deadline;
 		std::vector<std::pair<selector, std::function<void(node&)>>> callback_node;
 		std::vector<std::function<void(err_t, node&)>> callback_err;
 		enum class state_t {
@@ -194,9 +667,182 @@ namespace html {
 			attribute_value_single, attribute_value_unquoted, after_attribute_value_quoted, self_closing, bogus_comment, 
 			markup_dec_open_state, comment_start, comment_start_dash, comment, comment_end_dash, comment_end, 
 			before_doctype_name, doctype_name
-		} state;
+		} state = state_t::data;
+		friend class node;
+	};
+
+	class parser_pool {
+	public:
+		parser_pool(const parser& proto = parser()) : proto(proto) {}
+		parser& local();
+	private:
+		parser proto;
+		// identifies the pool in the parsers of each thread, expires with the pool
+		std::shared_ptr<const int> token = std::make_shared<const int>(0);
+	};
+
+	class parse_cache {
+	public:
+		parse_cache(size_t memory_limit = 64 * 1024 * 1024, const parser& proto = parser());
+		std::shared_ptr<const node> parse(const std::string&);
+		std::shared_ptr<const node> parse(const char*, size_t);
+		size_t hits() const {
+			return hit_count;
+		}
+		size_t misses() const {
+			return miss_count;
+		}
+		size_t memory() const;
+		void clear();
+	private:
+		struct key {
+			uint64_t hash[2];
+			size_t size;
+			bool operator==(const key& k) const {
+				return hash[0] == k.hash[0] && hash[1] == k.hash[1] && size == k.size;
+			}
+		};
+		struct key_hash {
+			size_t operator()(const key& k) const {
+				return static_cast<size_t>(k.hash[0]);
+			}
+		};
+		struct entry {
+			key id;
+			std::shared_ptr<const node> doc;
+			size_t memory;
+		};
+		parser_pool pool;
+		size_t memory_limit;
+		size_t memory_used = 0;
+		std::atomic<size_t> hit_count{0};
+		std::atomic<size_t> miss_count{0};
+		mutable std::mutex mutex;
+		std::list<entry> entries;
+		std::unordered_map<key, std::list<entry>::iterator, key_hash> index;
 	};
 
+	class flat_document {
+	public:
+		using handle = uint32_t;
+		static const handle npos = 0xffffffff;
+		// characters stored in the document, valid while it lives; `data` is null for a missing attribute
+		struct text_ref {
+			const char* data;
+			size_t size;
+			std::string str() const {
+				return data ? std::string(data, size) : std::string();
+			}
+			size_t find(const std::string&, size_t pos = 0) const;
+			bool operator==(const std::string& s) const {
+				return size == s.size() && std::equal(s.begin(), s.end(), data);
+			}
+			bool operator!=(const std::string& s) const {
+				return !(*this == s);
+			}
+		};
+		flat_document() = default;
+		explicit flat_document(const node&);
+		size_t size() const {
+			return types.size();
+		}
+		handle root() const {
+			return 0;
+		}
+		node_t type(handle h) const {
+			return static_cast<node_t>(types[h]);
+		}
+		bool self_closing(handle h) const {
+			return self_closed[h] != 0;
+		}
+		const std::string& tag_name(handle h) const {
+			return atoms[tags[h]];
+		}
+		text_ref content(handle h) const {
+			return text_ref{text.data() + text_begin[h], text_size[h]};
+		}
+		handle parent(handle h) const {
+			return parents[h];
+		}
+		handle first_child(handle h) const {
+			return first_children[h];
+		}
+		handle next_sibling(handle h) const {
+			return next_siblings[h];
+		}
+		// number of children and the `i`th child of node `h`
+		size_t size(handle h) const {
+			return child_begin[h + 1] - child_begin[h];
+		}
+		handle child(handle h, size_t i) const {
+			return children[child_begin[h] + i];
+		}
+		handle subtree_end(handle h) const {
+			return ends[h];
+		}
+		bool has_attr(handle h, const std::string& key) const {
+			return find_attr(h, key).data != nullptr;
+		}
+		text_ref get_attr(handle h, const std::string& key) const {
+			return find_attr(h, key);
+		}
+		std::vector<std::pair<std::string, std::string>> attributes(handle) const;
+		std::vector<handle> select(const selector&, handle = 0, bool nested = true) const;
+	private:
+		// read-only array in the storage of the document
+		template<class T>
+		class column {
+		public:
+			column() : ptr(nullptr), count(0) {}
+			column(const T* ptr, size_t count) : ptr(ptr), count(count) {}
+			const T& operator[](size_t i) const {
+				return ptr[i];
+			}
+			const T* data() const {
+				return ptr;
+			}
+			size_t size() const {
+				return count;
+			}
+		private:
+			const T* ptr;
+			size_t count;
+		};
+		text_ref find_attr(handle, const std::string&) const;
+		// nodes in document order, so the descendants of a node are the handles up to its subtree_end
+		column<uint8_t> types;
+		column<uint8_t> self_closed;
+		column<uint32_t> tags;
+		column<handle> parents;
+		column<handle> first_children;
+		column<handle> next_siblings;
+		column<handle> ends;
+		column<uint32_t> text_begin;
+		column<uint32_t> text_size;
+		// children of node `h` are in [child_begin[h], child_begin[h + 1])
+		column<uint32_t> child_begin;
+		column<handle> children;
+		// position among element siblings and the number of element children, as used by selectors
+		column<uint32_t> indices;
+		column<uint32_t> element_counts;
+		// attributes of node `h` are in [attr_begin[h], attr_begin[h + 1])
+		column<uint32_t> attr_begin;
+		column<uint32_t> attr_names;
+		// attribute values are stored in `text` along with the contents
+		column<uint32_t> attr_value_begin;
+		column<uint32_t> attr_value_size;
+		column<char> text;
+		std::vector<std::string> atoms;
+		// the arrays built from a tree or a mapped snapshot, shared by copies
+		std::shared_ptr<const void> storage;
+		friend void save_snapshot(const node&, const std::string&);
+		friend flat_document map_snapshot(const std::string&);
+		friend class selector;
+	};
+
+	std::vector<node_ptr> parse_batch(const std::vector<std::string>&, const parser& = parser(), unsigned threads = 0);
+	void parse_batch(const std::vector<std::string>&, std::function<void(size_t, node_ptr)>, const parser& = parser(), unsigned threads = 0);
+
 	namespace utils {
 
 		node make_node(node_t, const std::string&, const std::map<std::string, std::string>& attributes = {});
@@ -215,6 +861,7 @@ namespace html {
 		bool contains_word(const std::string&, const std::string&);
 		template<class InputIt>
 		bool ilook_ahead(InputIt, InputIt, const std::string&);
+		std::function<void(const char*, size_t)> fd_sink(int fd);
 		std::string replace_any_copy(const std::string&, const std::string&, const std::string&);
 		inline bool is_uppercase_alpha(char c) {
 			return 'A' <= c && c <= 'Z';
@@ -0,0 +1,94 @@
+#include <gtest/gtest.h>
+#include "html.hpp"
+#include <cstdio>
+#include <sstream>
+
+const char* page = "<!DOCTYPE html><html><head><title> T  x </title><script>a  <  b\n</script></head><body>\n"
+	"<div class=a id='b'>  lead  <b>bo  ld</b> <p>para\n\n text<br>x</p><!-- c --><ul><li>1<li>2 <span>s</span></ul></div>tail</body></html>";
+
+TEST(Output, Sinks) {
+	html::parser p;
+	auto doc = p.parse(page);
+	std::string large;
+	for(int i = 0; i < 1000; i++) {
+		large += page;
+	}
+	auto large_doc = p.parse(large);
+	for(auto n : {doc.get(), large_doc.get()}) {
+		std::ostringstream html, raw;
+		n->to_html(html, ' ');
+		n->to_raw_html(raw);
+		EXPECT_EQ(html.str(), n->to_html(' '));
+		EXPECT_EQ(raw.str(), n->to_raw_html());
+		size_t chunks = 0;
+		std::string collected;
+		n->to_raw_html([&](const char* data, size_t size) {
+			chunks++;
+			collected.append(data, size);
+		});
+		EXPECT_EQ(collected, n->to_raw_html());
+		EXPECT_GE(chunks, collected.size() / (64 * 1024));
+		std::FILE* f = std::tmpfile();
+		ASSERT_NE(f, nullptr);
+		n->to_html(html::utils::fd_sink(fileno(f)));
+		std::string written(static_cast<size_t>(std::ftell(f)), '\0');
+		std::rewind(f);
+		EXPECT_EQ(std::fread(&written[0], 1, written.size(), f), written.size());
+		std::fclose(f);
+		EXPECT_EQ(written, n->to_html());
+	}
+	EXPECT_EQ(doc->select("div")[0]->to_raw_html(), R"(<div class="a" id="b"> lead <b>bo ld</b><p>para text<br />x</p><!-- c --><ul><li>1<li>2 <span>s</span></li></li></ul></div>)");
+}
+
+TEST(Output, Text) {
+	html::parser p;
+	auto doc = p.parse(page);
+	html::text_options o;
+	EXPECT_EQ(doc->to_text(o), "lead bo ld\npara text\nx\n1\n2 s\ntail");
+	o.separator = " | ";
+	std::vector<std::pair<std::string, size_t>> offsets;
+	o.on_text = [&](const html::node& n, size_t offset) {
+		offsets.emplace_back(n.content, offset);
+	};
+	std::string text;
+	doc->to_text([&](const char* data, size_t size) {
+		text.append(data, size);
+	}, o);
+	EXPECT_EQ(text, "lead bo ld | para text | x | 1 | 2 s | tail");
+	ASSERT_EQ(offsets.size(), 8);
+	EXPECT_EQ(offsets[1], std::make_pair(std::string("bo  ld"), size_t(5)));
+	EXPECT_EQ(offsets[7], std::make_pair(std::string("tail"), size_t(39)));
+	o = html::text_options();
+	o.collapse = false;
+	o.skip_rawtext = false;
+	EXPECT_EQ(p.parse("<p>a  <b>b</b></p><script> x </script>")->to_text(o), "a  b\n x ");
+	// vertical tab is whitespace in text, as it was before the serializers were rewritten
+	auto vt = p.parse("<div>a\vb  c</div><p>\v</p>");
+	EXPECT_EQ(vt->at(0)->to_html(), "<div>a b c</div>");
+	EXPECT_EQ(vt->at(1)->to_html(), "<p> </p>");
+	EXPECT_EQ(vt->to_text(html::text_options()), "a b c");
+}
+
+TEST(Output, Minified) {
+	html::parser p;
+	auto doc = p.parse("<!DOCTYPE html><html><head><title> T  x </title><script>a  <  b\n</script></head><body>\n"
+		"<div class='a b' id=\"x\" data-v='say \"hi\"'>  lead  <b>bo  ld</b> <i>i</i> <!-- c --> <p>para\n\n text<br>x</p>\n<!--[if IE]>ie<![endif]-->"
+		"<ul>\n<li><input type=checkbox checked=checked disabled value=''></li>\n<li>2</li>\n</ul><pre>  a\n  b </pre><p>last</p></div>"
+		"<table><tr><td>1</td><td>2</td></tr></table></body></html>");
+	std::string expected = "<!DOCTYPE html><html><head><title> T  x </title><script>a  <  b\n</script><body>"
+		"<div class=\"a b\" data-v='say \"hi\"' id=x>lead <b>bo ld</b> <i>i</i><p>para text<br>x</p><!--[if IE]>ie<![endif]-->"
+		"<ul><li><input checked disabled type=checkbox value><li>2</ul><pre>  a\n  b </pre><p>last</div>"
+		"<table><tr><td>1<td>2</table>";
+	EXPECT_EQ(doc->to_minified_html(), expected);
+	std::ostringstream out;
+	doc->to_minified_html(out);
+	EXPECT_EQ(out.str(), expected);
+	EXPECT_EQ(doc->select("li")[0]->to_minified_html(), "<li><input checked disabled type=checkbox value></li>");
+	// an unquoted value does not take the slash of a self-closing tag
+	auto svg = p.parse(R"(<svg><path d="M0" /></svg><foo a="b"/><bar c="d e"/>)");
+	EXPECT_EQ(svg->to_minified_html(), R"(<svg><path d=M0 /></svg><foo a=b /><bar c="d e"/>)");
+	auto again = p.parse(svg->to_minified_html());
+	EXPECT_EQ(again->select("path")[0]->get_attr("d"), "M0");
+	EXPECT_TRUE(again->select("foo")[0]->self_closing);
+	EXPECT_TRUE(html::diff(*svg, *again).empty());
+}
@@ -0,0 +1,859 @@
+#include <gtest/gtest.h>
+#include "html.hpp"
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+std::vector<std::string> batch_inputs() {
+	std::vector<std::string> inputs;
+	for(int i = 0; i < 50; i++) {
+		std::string doc = "<div id=\"d" + std::to_string(i) + "\">";
+		for(int j = 0; j < i; j++) {
+			doc += "<p>" + std::to_string(j) + "</p>";
+		}
+		inputs.push_back(doc + "</div>");
+	}
+	return inputs;
+}
+
+TEST(Batch, SameAsSerial) {
+	auto inputs = batch_inputs();
+	auto docs = html::parse_batch(inputs, html::parser(), 4);
+	ASSERT_EQ(docs.size(), inputs.size());
+	html::parser p;
+	for(size_t i = 0; i < inputs.size(); i++) {
+		EXPECT_EQ(docs[i]->to_raw_html(), p.parse(inputs[i])->to_raw_html());
+	}
+}
+
+TEST(Batch, Sink) {
+	auto inputs = batch_inputs();
+	std::vector<bool> seen(inputs.size());
+	size_t paragraphs = 0;
+	html::parse_batch(inputs, [&](size_t i, html::node_ptr doc) {
+		seen[i] = true;
+		paragraphs += doc->select("p").size();
+	}, html::parser(), 3);
+	EXPECT_EQ(std::count(seen.begin(), seen.end(), true), 50);
+	EXPECT_EQ(paragraphs, 49 * 50 / 2);
+}
+
+TEST(Parallel, SameAsSerial) {
+	const char* pieces[] = {
+		"<div class=\"a\">text <b>bold</b></div>",
+		"<script>if(a < b && c > d) { e('<div>'); }</script>",
+		"<!-- a comment with <p>tags</p> inside -->",
+		"<style>p > a { color: red; }</style>",
+		"<div><p title='x > y'>para<p>unclosed</div>",
+		"<ul><li>one<li>two</ul>",
+		"a < b text",
+	};
+	std::string doc;
+	for(size_t i = 0; doc.size() < 3 * 1024 * 1024; i++) {
+		doc += pieces[(i * 7 + i / 3) % (sizeof(pieces) / sizeof(pieces[0]))];
+	}
+	html::parser p;
+	auto serial = p.parse(doc);
+	auto parallel = p.parse_parallel(doc, 4);
+	EXPECT_EQ(parallel->size(), serial->size());
+	EXPECT_EQ(parallel->to_raw_html(), serial->to_raw_html());
+}
+
+TEST(Pool, ThreadLocal) {
+	html::parser_pool pool;
+	html::parser* main = &pool.local();
+	EXPECT_EQ(&pool.local(), main);
+	html::parser* other = nullptr;
+	std::thread([&]() {
+		other = &pool.local();
+		EXPECT_EQ(other->parse("<p>a</p><p>b</p>")->size(), 2);
+	}).join();
+	EXPECT_NE(other, main);
+}
+
+TEST(Pool, Reuse) {
+	html::parser p;
+	auto first = p.parse("<div><p>a</p></div>text")->to_raw_html();
+	p.parse("<script>unterminated");
+	p.reset();
+	EXPECT_EQ(p.parse("<div><p>a</p></div>text")->to_raw_html(), first);
+
+	html::parser_pool pool;
+	html::parser& local = pool.local();
+	size_t errors = 0;
+	local.set_callback([&errors](html::err_t, html::node&) {
+		errors++;
+	});
+	local.parse("<ul><li>a<div><span>b</div>");
+	local.parse("<div><p class='unterminated");
+	EXPECT_GT(errors, 0);
+	errors = 0;
+	std::string clean = "<p id=\"a\">a <b>b</b></p>text<!--c-->";
+	auto doc = pool.local().parse(clean);
+	EXPECT_EQ(errors, 0);
+	EXPECT_EQ(doc->to_raw_html(), html::parser().parse(clean)->to_raw_html());
+	EXPECT_EQ(doc->at(0)->source_range(), std::make_pair(size_t(0), size_t(24)));
+}
+
+TEST(File, SameAsString) {
+	std::string doc = "<!DOCTYPE html><body><div attr=\"val\">text</div><!--comment--></body>";
+	std::string path = testing::TempDir() + "htmlparser_parse_file.html";
+	std::ofstream(path, std::ios::binary) << doc;
+	html::parser p;
+	EXPECT_EQ(p.parse_file(path)->to_raw_html(), p.parse(doc)->to_raw_html());
+	std::remove(path.c_str());
+	EXPECT_THROW(p.parse_file(path), std::system_error);
+}
+
+TEST(Stream, SameAsString) {
+	const std::string piece = "<!DOCTYPE html><!--c--><p a='1' b=\"two\">t</p><script>x</script>";
+	html::parser p;
+	html::parse_options o;
+	o.lazy_attributes = true;
+	html::parser lazy(o);
+	for(size_t shift = 0; shift < piece.size(); shift++) {
+		std::string doc(shift, 'x');
+		while(doc.size() < 70 * 1024) {
+			doc += piece;
+		}
+		std::istringstream in(doc);
+		std::string expected = p.parse(doc)->to_raw_html();
+		ASSERT_EQ(p.parse(in)->to_raw_html(), expected);
+		std::istringstream lazy_in(doc);
+		ASSERT_EQ(lazy.parse(lazy_in)->to_raw_html(), expected);
+	}
+}
+
+const char* pruned_page = "<!DOCTYPE html><head><script>if(a < b) { c('</div>'); }</script><style>p {}</style></head>"
+	"<body> <!--comment--> <p>text</p>\n<noscript><img src=x></noscript></body>";
+
+TEST(Options, Drop) {
+	html::parse_options o;
+	o.drop_comments = true;
+	o.drop_whitespace = true;
+	o.drop_doctype = true;
+	html::parser p(o);
+	auto doc = p.parse(pruned_page);
+	ASSERT_EQ(doc->size(), 2);
+	EXPECT_EQ(doc->at(0)->tag_name, "head");
+	EXPECT_EQ(doc->at(1)->size(), 2);
+	EXPECT_EQ(doc->at(1)->at(0)->tag_name, "p");
+}
+
+TEST(Options, PruneChildren) {
+	html::parse_options o;
+	o.prune = html::prune_t::children;
+	html::parser p(o);
+	auto doc = p.parse(pruned_page);
+	auto scripts = doc->select("script,style,noscript");
+	ASSERT_EQ(scripts.size(), 3);
+	for(auto n : scripts) {
+		EXPECT_TRUE(n->empty());
+	}
+	EXPECT_EQ(doc->select("p").size(), 1);
+}
+
+TEST(Options, PruneElement) {
+	html::parse_options o;
+	o.prune = html::prune_t::element;
+	html::parser p(o);
+	int callbacks = 0;
+	p.set_callback("script,style,noscript", [&](html::node&) {
+		callbacks++;
+	});
+	auto doc = p.parse(pruned_page);
+	EXPECT_TRUE(doc->at(1)->empty());
+	EXPECT_EQ(doc->select("script,style,noscript").size(), 0);
+	EXPECT_EQ(doc->select("body p").size(), 1);
+	EXPECT_EQ(callbacks, 0);
+}
+
+TEST(Options, KeepAttributes) {
+	html::parse_options o;
+	o.keep_attributes = {"href", "src"};
+	o.keep_selector_attributes("div.main");
+	html::parser p(o);
+	std::vector<html::node*> matched;
+	p.set_callback("[data-id='1']", [&](html::node& n) {
+		matched.push_back(&n);
+	});
+	auto doc = p.parse(R"(<div class="main" style="color: red" onclick='x()'><a href="/a" data-id=1 data-x=2 rel=nofollow>a</a></div>)");
+	auto div = doc->select("div.main");
+	ASSERT_EQ(div.size(), 1);
+	EXPECT_FALSE(div[0]->has_attr("style"));
+	EXPECT_FALSE(div[0]->has_attr("onclick"));
+	EXPECT_EQ(div[0]->at(0)->to_raw_html(), R"(<a data-id="1" href="/a">a</a>)");
+	ASSERT_EQ(matched.size(), 1);
+	EXPECT_EQ(matched[0]->tag_name, "a");
+}
+
+TEST(Options, LazyAttributes) {
+	std::string doc = R"(<div id=main class="a b" data-x='1 > 2'><a href=/x?a=b&c title="t" checked>l</a><br/><img src=x /><p a=1 a=2 =b/c>p</p></div>)";
+	html::parse_options o;
+	o.lazy_attributes = true;
+	html::parser lazy(o), eager;
+	auto l = lazy.parse(doc), e = eager.parse(doc);
+	EXPECT_EQ(l->select("#main .b").size(), 0);
+	EXPECT_EQ(l->select("div#main.a a[href^='/x']").size(), 1);
+	EXPECT_EQ(l->at(0)->get_attr("data-x"), "1 > 2");
+	EXPECT_EQ(l->to_raw_html(), e->to_raw_html());
+	std::istringstream in(doc);
+	EXPECT_EQ(lazy.parse(in)->to_raw_html(), e->to_raw_html());
+	// attribute options are applied, attributes are then read while parsing
+	o.keep_attributes = {"href", "src"};
+	o.max_attribute_length = 2;
+	html::parser kept(o);
+	int errors = 0;
+	kept.set_callback([&errors](html::err_t, html::node&) {
+		errors++;
+	});
+	EXPECT_EQ(kept.parse(doc)->to_raw_html(), R"(<div><a href="/x">l</a><br /><img src="x" /><p>p</p></div>)");
+	EXPECT_EQ(errors, 1);
+}
+
+TEST(Options, Skim) {
+	std::string doc = "<!DOCTYPE html><body><div id=a><p>one<b>bold</b></p><script>x('</div>')</script><ul><li>1<li>2</ul></div>"
+		"<div id=b><p>two<img src=x></p><br/></div><span>s</span></body>";
+	html::parser eager;
+	std::string expected = eager.parse(doc)->to_raw_html();
+	html::parse_options o;
+	o.skim_depth = 1;
+	html::parser p(o);
+	int callbacks = 0;
+	p.set_callback("p", [&](html::node& n) {
+		callbacks += n.type_tag == html::tag_t::open;
+	});
+	auto skimmed = p.parse(doc);
+	EXPECT_EQ(callbacks, 0);
+	html::node copy = *skimmed->at(1);
+	EXPECT_EQ(skimmed->select("div#a li").size(), 2);
+	EXPECT_EQ(skimmed->to_raw_html(), expected);
+	EXPECT_EQ(copy.to_raw_html(), eager.parse(doc)->at(1)->to_raw_html());
+	o.skim_filter = "div#b";
+	html::parser filtered(o);
+	filtered.set_callback("p,img", [&](html::node& n) {
+		callbacks += n.type_tag == html::tag_t::open;
+	});
+	auto doc_f = filtered.parse(doc);
+	EXPECT_EQ(callbacks, 2);
+	EXPECT_EQ(doc_f->to_raw_html(), expected);
+	// every part of the filter has to match, not only the first one
+	callbacks = 0;
+	o.skim_filter = "body > div#b";
+	filtered.set_options(o);
+	filtered.parse(doc);
+	EXPECT_EQ(callbacks, 2);
+	callbacks = 0;
+	o.skim_filter = "span div#b";
+	filtered.set_options(o);
+	filtered.parse(doc);
+	EXPECT_EQ(callbacks, 0);
+	// attributes the filter reads are kept along with keep_attributes
+	o.skim_filter = "div#b";
+	o.keep_attributes = {"src"};
+	filtered.set_options(o);
+	filtered.parse(doc);
+	EXPECT_EQ(callbacks, 2);
+	// a skimmed element that ends in an incomplete tag keeps its text
+	html::parse_options top;
+	top.skim_depth = 0;
+	html::parser skim_all(top);
+	for(const char* s : {"<p><</p>", "<b>x<y</b><</b>", "<div><p>a<</p>b<"}) {
+		EXPECT_EQ(skim_all.parse(s)->to_raw_html(), eager.parse(s)->to_raw_html()) << s;
+	}
+	std::istringstream in(doc);
+	EXPECT_EQ(p.parse(in)->to_raw_html(), expected);
+	std::string large;
+	while(large.size() < 2 * 1024 * 1024) {
+		large += doc;
+	}
+	EXPECT_EQ(p.parse_parallel(large, 4)->to_raw_html(), eager.parse(large)->to_raw_html());
+}
+
+TEST(Parser, Stop) {
+	std::string doc = "<html><head><title>t</title><meta charset=utf-8><link rel=icon></head><body><p>text</p></body></html>";
+	html::parser p;
+	std::string charset;
+	p.set_callback("meta[charset]", [&](html::node& n) {
+		charset = n.get_attr("charset");
+		p.stop();
+	});
+	auto node = p.parse(doc);
+	EXPECT_EQ(charset, "utf-8");
+	EXPECT_EQ(node->to_raw_html(), R"(<html><head><title>t</title><meta charset="utf-8" /></head></html>)");
+	EXPECT_EQ(node->select("link,body").size(), 0);
+	std::istringstream in(doc);
+	EXPECT_EQ(p.parse(in)->to_raw_html(), node->to_raw_html());
+	p.clear_callbacks();
+	EXPECT_EQ(p.parse(doc)->select("p").size(), 1);
+}
+
+TEST(Options, Limits) {
+	std::string nested;
+	for(int i = 0; i < 100000; i++) {
+		nested += "<div>";
+	}
+	html::parse_options o;
+	o.max_depth = 100;
+	o.max_attributes = 2;
+	o.max_attribute_length = 3;
+	o.max_text = 4;
+	html::parser p(o);
+	std::map<html::err_t, int> errors;
+	p.set_callback([&](html::err_t e, html::node&) {
+		errors[e]++;
+	});
+	auto doc = p.parse(nested + "text");
+	EXPECT_EQ(errors[html::err_t::too_deep], 100000 - 100);
+	EXPECT_EQ(doc->select("div").size(), 100);
+	EXPECT_EQ(doc->select("div:eq(0)").size(), 100);
+	// closing tags of elements over the limit do not close the ones above it
+	html::parse_options d;
+	d.max_depth = 2;
+	html::parser shallow(d);
+	EXPECT_EQ(shallow.parse("<div><div><div>a<div>b</div>c</div>d</div>e</div>f")->to_raw_html(), "<div><div>abcd</div>e</div>f");
+	EXPECT_EQ(shallow.parse("<div><p><div><script>x</div></script>y</div>z</p></div>")->to_raw_html(), "<div><p>yz</p></div>");
+	EXPECT_EQ(shallow.parse("<div><p><span>a</p>b</div>c")->to_raw_html(), "<div><p>a</p>b</div>c");
+	errors.clear();
+	doc.reset();
+	doc = p.parse("<p a=1 b=22222 c=3 d=4>long text</p><script>12345</script>");
+	EXPECT_EQ(doc->to_raw_html(), R"(<p a="1" b="222">long</p><script>1234</script>)");
+	EXPECT_EQ(errors[html::err_t::too_many_attributes], 1);
+	EXPECT_EQ(errors[html::err_t::attribute_too_long], 1);
+	EXPECT_EQ(errors[html::err_t::text_too_long], 2);
+	// the first attributes in document order are kept
+	EXPECT_EQ(p.parse("<p d=1 c=2 a=3 b=4></p>")->to_raw_html(), R"(<p c="2" d="1"></p>)");
+	EXPECT_EQ(errors[html::err_t::too_many_attributes], 2);
+	// limited values are cut while they are read
+	std::istringstream in("<p a='" + std::string(1000, 'x') + "'>" + std::string(1000, 'y') + "<!--" + std::string(1000, 'z') + "-->");
+	doc = p.parse(in);
+	EXPECT_EQ(doc->to_raw_html(), R"(<p a="xxx">yyyy<!--zzzz--></p>)");
+	EXPECT_EQ(errors[html::err_t::attribute_too_long], 2);
+	EXPECT_EQ(errors[html::err_t::text_too_long], 4);
+	html::parse_options n;
+	n.max_nodes = 3;
+	html::parser counted(n);
+	counted.set_callback([&](html::err_t e, html::node&) {
+		errors[e]++;
+	});
+	EXPECT_EQ(counted.parse("<p>a</p><p>b</p><p>c</p>")->to_raw_html(), "<p>a</p><p></p>");
+	EXPECT_EQ(errors[html::err_t::too_many_nodes], 1);
+	// the element that stays in the tree is reported, not the one left out
+	std::vector<std::string> reported;
+	shallow.set_callback([&](html::err_t, html::node& n) {
+		reported.push_back(n.tag_name);
+	});
+	auto kept = shallow.parse("<div><p><span>a</span></p></div>");
+	EXPECT_EQ(reported, std::vector<std::string>({"p"}));
+}
+
+TEST(Options, Cancel) {
+	std::string doc;
+	while(doc.size() < 1024 * 1024) {
+		doc += "<p>text</p>";
+	}
+	std::atomic<bool> cancel(true);
+	html::parse_options o;
+	o.cancel = &cancel;
+	html::parser p(o);
+	int cancelled = 0;
+	p.set_callback([&](html::err_t e, html::node&) {
+		cancelled += e == html::err_t::cancelled;
+	});
+	EXPECT_LT(p.parse(doc)->size(), 1000);
+	EXPECT_EQ(cancelled, 1);
+	EXPECT_LT(p.parse_parallel(doc, 4)->size(), 1000);
+	EXPECT_EQ(cancelled, 2);
+	o.cancel = nullptr;
+	o.timeout = std::chrono::steady_clock::duration::zero() - std::chrono::seconds(1);
+	p.set_options(o);
+	EXPECT_LT(p.parse(doc)->size(), 1000);
+	cancel = false;
+	o.timeout = std::chrono::seconds(60);
+	p.set_options(o);
+	EXPECT_EQ(p.parse(doc)->size(), doc.size() / 11);
+}
+
+std::vector<std::pair<size_t, size_t>> source_ranges(html::node& doc) {
+	std::vector<std::pair<size_t, size_t>> ranges(1, doc.source_range());
+	doc.walk([&](html::node& n) {
+		ranges.push_back(n.source_range());
+		return true;
+	});
+	return ranges;
+}
+
+TEST(Parser, SourceRange) {
+	std::string doc = "<!DOCTYPE html><div id=a>text <b>bold</b><!--c--><script>x('</div>')</script><p>open<br/></div>tail<i>unclosed";
+	html::parser p;
+	auto node = p.parse(doc);
+	EXPECT_EQ(node->source_html(doc), doc);
+	EXPECT_EQ(node->at(0)->source_html(doc), "<!DOCTYPE html>");
+	auto div = node->at(1);
+	EXPECT_EQ(div->source_html(doc), "<div id=a>text <b>bold</b><!--c--><script>x('</div>')</script><p>open<br/></div>");
+	EXPECT_EQ(div->at(0)->source_html(doc), "text ");
+	EXPECT_EQ(div->at(1)->source_html(doc), "<b>bold</b>");
+	EXPECT_EQ(div->at(2)->source_html(doc), "<!--c-->");
+	EXPECT_EQ(div->at(3)->source_html(doc), "<script>x('</div>')</script>");
+	EXPECT_EQ(div->at(3)->at(0)->source_html(doc), "x('</div>')");
+	EXPECT_EQ(div->at(4)->source_html(doc), "<p>open<br/>");
+	EXPECT_EQ(node->at(3)->source_html(doc), "<i>unclosed");
+	EXPECT_EQ(node->at(3)->at(0)->source_html(doc), "unclosed");
+	std::string large;
+	while(large.size() < 1024 * 1024) {
+		large += doc.substr(15, 82);
+	}
+	auto expected = source_ranges(*p.parse(large));
+	std::istringstream in(large);
+	EXPECT_EQ(source_ranges(*p.parse(in)), expected);
+	EXPECT_EQ(source_ranges(*p.parse_parallel(large, 4)), expected);
+	html::parse_options o;
+	o.skim_depth = 0;
+	html::parser skim(o);
+	EXPECT_EQ(source_ranges(*skim.parse(large)), expected);
+}
+
+TEST(Snapshot, SameAsParsed) {
+	std::string doc = "<!DOCTYPE html><div id=a class='x y'>text <b>bold</b><!--c--><script>x('</div>')</script><p>a<br/></div><i>unclosed";
+	html::parser p;
+	auto parsed = p.parse(doc);
+	std::string path = testing::TempDir() + "htmlparser_snapshot.bin";
+	html::save_snapshot(*parsed, path);
+	auto loaded = html::load_snapshot(path);
+	EXPECT_EQ(loaded->to_raw_html(), parsed->to_raw_html());
+	EXPECT_EQ(source_ranges(*loaded), source_ranges(*parsed));
+	EXPECT_EQ(loaded->select("div#a.y b:eq(0)").size(), 1);
+	EXPECT_EQ(loaded->select("div")[0]->get_parent(), loaded.get());
+	std::ofstream(path, std::ios::binary | std::ios::app) << "x";
+	EXPECT_THROW(html::load_snapshot(path), std::runtime_error);
+	std::remove(path.c_str());
+	EXPECT_THROW(html::load_snapshot(path), std::system_error);
+}
+
+TEST(Snapshot, MappedFlatDocument) {
+	html::parser p;
+	auto parsed = p.parse("<!DOCTYPE html><div id=a class='x y'>text <b>bold</b><!--c--><ul><li>1</li><li class=y>2</li></ul><img src=a.png></div>");
+	html::flat_document flat(*parsed);
+	std::string path = testing::TempDir() + "htmlparser_mapped.bin";
+	html::save_snapshot(*parsed, path);
+	html::flat_document mapped;
+	{
+		// copies share the mapping
+		html::flat_document view = html::map_snapshot(path);
+		mapped = view;
+	}
+	ASSERT_EQ(mapped.size(), flat.size());
+	for(html::flat_document::handle h = 0; h < flat.size(); h++) {
+		EXPECT_EQ(mapped.type(h), flat.type(h));
+		EXPECT_EQ(mapped.tag_name(h), flat.tag_name(h));
+		EXPECT_EQ(mapped.content(h).str(), flat.content(h).str());
+		EXPECT_EQ(mapped.self_closing(h), flat.self_closing(h));
+		EXPECT_EQ(mapped.parent(h), flat.parent(h));
+		EXPECT_EQ(mapped.subtree_end(h), flat.subtree_end(h));
+		EXPECT_EQ(mapped.size(h), flat.size(h));
+		EXPECT_EQ(mapped.attributes(h), flat.attributes(h));
+	}
+	for(const char* s : {"div li", "li:eq(1)", ".y", "[src$=png]", "#a > *"}) {
+		EXPECT_EQ(mapped.select(s), flat.select(s)) << s;
+	}
+	EXPECT_EQ(mapped.get_attr(mapped.select("li.y")[0], "class"), "y");
+	std::ofstream(path, std::ios::binary | std::ios::app) << "x";
+	EXPECT_THROW(html::map_snapshot(path), std::runtime_error);
+	std::remove(path.c_str());
+}
+
+TEST(Cache, SharedDocuments) {
+	html::parse_options o;
+	o.lazy_attributes = true;
+	html::parse_cache cache(16 * 1024, html::parser(o));
+	auto first = cache.parse("<p a=1>one</p>");
+	EXPECT_EQ(cache.parse(std::string("<p a=1>one</p>")), first);
+	EXPECT_NE(cache.parse("<p a=1>two</p>"), first);
+	EXPECT_EQ(cache.hits(), 1);
+	EXPECT_EQ(cache.misses(), 2);
+	EXPECT_EQ(first->to_raw_html(), R"(<p a="1">one</p>)");
+	std::string large;
+	while(large.size() < 64 * 1024) {
+		large += "<p>text</p>";
+	}
+	EXPECT_EQ(cache.parse(large)->size(), large.size() / 11);
+	EXPECT_NE(cache.parse(large), cache.parse(large));
+	for(int i = 0; i < 1000; i++) {
+		cache.parse("<div>" + std::to_string(i) + "</div>");
+	}
+	EXPECT_LE(cache.memory(), 16 * 1024);
+	EXPECT_NE(cache.parse("<p a=1>one</p>"), first);
+	std::vector<std::thread> threads;
+	for(int t = 0; t < 4; t++) {
+		threads.emplace_back([&]() {
+			for(int i = 0; i < 200; i++) {
+				EXPECT_EQ(cache.parse("<b>" + std::to_string(i % 20) + "</b>")->at(0)->at(0)->content, std::to_string(i % 20));
+				// hashes of cached documents are only read
+				EXPECT_EQ(html::diff(*cache.parse("<b>0</b>"), *cache.parse("<b>" + std::to_string(i % 20) + "</b>")).size(), i % 20 ? 1 : 0);
+			}
+		});
+	}
+	for(auto& t : threads) {
+		t.join();
+	}
+	cache.clear();
+	EXPECT_EQ(cache.memory(), 0);
+}
+
+TEST(Hash, Diff) {
+	std::string doc = "<div id=a><p>one</p><p class=x>two</p></div><ul><li>1</li></ul>";
+	html::parser p;
+	auto a = p.parse(doc), b = p.parse(doc);
+	EXPECT_EQ(a->subtree_hash(), b->subtree_hash());
+	EXPECT_TRUE(html::diff(*a, *b).empty());
+	auto root_hash = b->subtree_hash();
+	auto ul_hash = b->at(1)->subtree_hash();
+	b->select("p.x")[0]->set_attr("class", "y");
+	EXPECT_NE(b->subtree_hash(), root_hash);
+	EXPECT_EQ(b->at(1)->subtree_hash(), ul_hash);
+	auto changes = html::diff(*a, *b);
+	ASSERT_EQ(changes.size(), 1);
+	EXPECT_EQ(changes[0].second, b->select("p.y")[0]);
+	b->select("p.y")[0]->del_attr("class");
+	b->at(1)->append(html::utils::make_node(html::node_t::tag, "li"));
+	changes = html::diff(*a, *b);
+	ASSERT_EQ(changes.size(), 2);
+	EXPECT_EQ(changes[1].first, a->at(1));
+	b->at(1)->at(1)->append(html::utils::make_node(html::node_t::text, "2"));
+	EXPECT_NE(b->subtree_hash(), p.parse(doc + "x")->subtree_hash());
+	EXPECT_EQ(html::node(*b).subtree_hash(), b->subtree_hash());
+	EXPECT_EQ(p.parse("<div id=a><p>one</p><p>two</p></div><ul><li>1</li><li>2</li></ul>")->subtree_hash(), b->subtree_hash());
+}
+
+TEST(Options, StringPool) {
+	std::string doc = R"(<div class="item" rel="nofollow"><a class="item" href="/a">a</a><a class="item" href="/b" rel="nofollow">b</a></div>)";
+	html::parser eager;
+	html::parse_options o;
+	o.pool = std::make_shared<html::string_pool>();
+	html::parser pooled(o);
+	auto a = pooled.parse(doc), b = pooled.parse(doc);
+	EXPECT_EQ(o.pool->size(), 7);
+	EXPECT_EQ(a->to_raw_html(), eager.parse(doc)->to_raw_html());
+	EXPECT_EQ(a->select("a.item[href='/b'][rel]").size(), 1);
+	EXPECT_EQ(a->subtree_hash(), eager.parse(doc)->subtree_hash());
+	html::node copy = *b->at(0);
+	b->at(0)->at(0)->set_attr("href", "/c");
+	EXPECT_EQ(b->at(0)->at(0)->get_attr("href"), "/c");
+	EXPECT_EQ(b->at(0)->at(0)->get_attr("class"), "item");
+	EXPECT_EQ(a->at(0)->at(0)->get_attr("href"), "/a");
+	EXPECT_EQ(copy.at(0)->get_attr("href"), "/a");
+	// values past the limits stay in the nodes
+	o.pool = std::make_shared<html::string_pool>(2, 4);
+	pooled.set_options(o);
+	a = pooled.parse(doc + R"(<p title="a long title" class="item">x</p>)");
+	EXPECT_EQ(o.pool->size(), 4 + 2);
+	EXPECT_EQ(a->to_raw_html(), eager.parse(doc + R"(<p title="a long title" class="item">x</p>)")->to_raw_html());
+	EXPECT_EQ(a->at(1)->get_attr("title"), "a long title");
+	EXPECT_EQ(a->select("a[href='/b']").size(), 1);
+	// documents and their copies keep the pool alive
+	std::unique_ptr<html::node> kept;
+	{
+		html::parse_options scoped;
+		scoped.pool = std::make_shared<html::string_pool>();
+		html::parser p(scoped);
+		a = p.parse(doc);
+		kept.reset(new html::node(*a->at(0)));
+	}
+	o.pool.reset();
+	pooled.set_options(html::parse_options());
+	EXPECT_EQ(a->to_raw_html(), eager.parse(doc)->to_raw_html());
+	a.reset();
+	EXPECT_EQ(kept->at(1)->get_attr("href"), "/b");
+}
+
+TEST(Clone, SharedSubtrees) {
+	std::string doc = "<div id=a><p>one <b>b</b></p><p>two</p></div><ul><li>1</li><li>2</li></ul>";
+	html::parser p;
+	std::shared_ptr<const html::node> base(p.parse(doc));
+	std::string expected = base->to_raw_html();
+	auto first = html::clone(base), second = html::clone(base);
+	EXPECT_EQ(first->to_raw_html(), expected);
+	second->select("li:eq(1)")[0]->set_attr("class", "x");
+	second->at(0)->append(html::utils::make_node(html::node_t::tag, "hr"));
+	EXPECT_EQ(second->to_raw_html(), R"(<div id="a"><p>one <b>b</b></p><p>two</p><hr /></div><ul><li>1</li><li class="x">2</li></ul>)");
+	EXPECT_EQ(second->select("div > p:eq(1)")[0]->get_parent(), second->at(0));
+	EXPECT_EQ(base->to_raw_html(), expected);
+	EXPECT_EQ(first->to_raw_html(), expected);
+	// reading a clone stays on the shared nodes, changes copy only the levels above the changed node
+	auto nodes = [](const html::node& n) {
+		std::vector<const html::node*> ret;
+		n.walk([&](const html::node& c) {
+			ret.push_back(&c);
+			return true;
+		});
+		return ret;
+	};
+	// a clone hashed before the shared document is, then changed
+	auto hashed = html::clone(base);
+	auto hash = hashed->subtree_hash();
+	hashed->at(0)->set_attr("id", "zzz");
+	EXPECT_NE(hashed->subtree_hash(), hash);
+	EXPECT_EQ(hashed->subtree_hash(), p.parse(hashed->to_raw_html())->subtree_hash());
+	auto third = html::clone(base);
+	EXPECT_EQ(third->subtree_hash(), base->subtree_hash());
+	EXPECT_TRUE(html::diff(*third, *base).empty());
+	EXPECT_EQ(nodes(*third), nodes(*base));
+	html::node* b = third->select("div b")[0];
+	EXPECT_EQ(b->get_parent()->get_parent()->get_parent(), third.get());
+	b->set_attr("class", "y");
+	auto after = nodes(*third), before = nodes(*base);
+	EXPECT_NE(after[0], before[0]);
+	// the levels of div, p and b are copied; the text in b, the text of the second p and the items of ul are not
+	EXPECT_EQ(after[4], before[4]);
+	EXPECT_EQ(after[6], before[6]);
+	EXPECT_EQ(std::vector<const html::node*>(after.begin() + 8, after.end()), std::vector<const html::node*>(before.begin() + 8, before.end()));
+	EXPECT_EQ(base->to_raw_html(), expected);
+	// copies of copies, and documents with removed nodes
+	html::node_ptr edited = p.parse(doc);
+	edited->select("li")[0]->remove();
+	std::shared_ptr<const html::node> shared_clone(html::clone(std::shared_ptr<const html::node>(std::move(edited))));
+	auto fourth = html::clone(shared_clone);
+	EXPECT_EQ(fourth->to_raw_html(), R"(<div id="a"><p>one <b>b</b></p><p>two</p></div><ul><li>2</li></ul>)");
+	fourth->select("li:eq(0)")[0]->append(html::utils::make_node(html::node_t::text, "3"));
+	EXPECT_EQ(fourth->select("ul")[0]->to_raw_html(), "<ul><li>23</li></ul>");
+	EXPECT_EQ(shared_clone->to_raw_html(), R"(<div id="a"><p>one <b>b</b></p><p>two</p></div><ul><li>2</li></ul>)");
+	std::vector<std::thread> threads;
+	for(int t = 0; t < 4; t++) {
+		threads.emplace_back([&base, &expected]() {
+			for(int i = 0; i < 100; i++) {
+				auto c = html::clone(base);
+				EXPECT_EQ(c->to_raw_html(), expected);
+				c->select("p")[1]->set_attr("id", std::to_string(i));
+				EXPECT_EQ(c->subtree_hash() == base->subtree_hash(), false);
+			}
+		});
+	}
+	for(auto& t : threads) {
+		t.join();
+	}
+	html::node copy = *html::clone(base);
+	base.reset();
+	EXPECT_EQ(copy.to_raw_html(), expected);
+}
+
+TEST(Build, MoveAndSplice) {
+	html::node div = html::utils::make_node(html::node_t::tag, "div");
+	html::node a = html::utils::make_node(html::node_t::tag, "a", {{"href", "/"}});
+	a.append(html::utils::make_node(html::node_t::text, "link"));
+	div.append(html::utils::make_node(html::node_t::text, "text"));
+	div.append(std::move(a));
+	div.append(html::utils::make_unique<html::node>(html::utils::make_node(html::node_t::tag, "br")));
+	EXPECT_EQ(div.to_raw_html(), R"(<div>text<a href="/">link</a><br /></div>)");
+	EXPECT_EQ(div.at(1)->at(0)->get_parent(), div.at(1));
+	EXPECT_EQ(div.select("br:eq(1)").size(), 1);
+
+	html::parser p;
+	html::node_ptr doc = p.parse("<ul><li>1</li><li>2</li><li>3</li></ul><ol><li>4</li></ol>");
+	html::node* ul = doc->at(0);
+	html::node* ol = doc->at(1);
+	html::node* li = ul->at(1);
+	ol->adopt(*li);
+	EXPECT_EQ(li->get_parent(), ol);
+	EXPECT_EQ(doc->to_raw_html(), "<ul><li>1</li><li>3</li></ul><ol><li>4</li><li>2</li></ol>");
+	EXPECT_EQ(doc->select("ul > li:eq(1)")[0]->to_text(), "3");
+	EXPECT_EQ(doc->select("ol > li:eq(1)")[0], li);
+	EXPECT_THROW(li->adopt(*ol), std::invalid_argument);
+	EXPECT_THROW(li->adopt(*doc), std::invalid_argument);
+
+	ol->splice(*ul);
+	EXPECT_TRUE(ul->empty());
+	EXPECT_EQ(doc->to_raw_html(), "<ul></ul><ol><li>4</li><li>2</li><li>1</li><li>3</li></ol>");
+	EXPECT_EQ(doc->select("ol > li:gt(2)").size(), 1);
+	EXPECT_EQ(ol->at(3)->get_parent(), ol);
+	ul->append(html::utils::make_node(html::node_t::tag, "li"));
+	EXPECT_EQ(doc->select("ul > li:eq(0)").size(), 1);
+}
+
+TEST(Build, RemoveAndInsert) {
+	html::parser p;
+	html::node_ptr doc = p.parse("<ul><li>1</li><li>2</li><li>3</li><li>4</li><li>5</li></ul>");
+	html::node* ul = doc->at(0);
+	for(auto li : doc->select("li:gt(0)")) {
+		if(li->to_text() == "2" || li->to_text() == "4") {
+			li->remove();
+		}
+	}
+	EXPECT_EQ(ul->to_raw_html(), "<ul><li>1</li><li>3</li><li>5</li></ul>");
+	EXPECT_EQ(doc->select("li:eq(2)")[0]->to_text(), "5");
+
+	html::node* li = ul->at(1);
+	html::node& inserted = li->insert_before(html::utils::make_node(html::node_t::tag, "hr"));
+	EXPECT_EQ(inserted.get_parent(), ul);
+	html::node_ptr old = ul->at(0)->replace_with(html::utils::make_node(html::node_t::text, "text"));
+	EXPECT_EQ(old->get_parent(), nullptr);
+	EXPECT_EQ(old->to_raw_html(), "<li>1</li>");
+	html::node_ptr last = ul->at(3)->detach();
+	EXPECT_EQ(ul->to_raw_html(), "<ul>text<hr /><li>3</li></ul>");
+	EXPECT_EQ(doc->select("li:eq(1)")[0]->to_text(), "3");
+	EXPECT_EQ(doc->select("hr:first").size(), 1);
+	li->insert_before(std::move(old));
+	ul->append(std::move(last));
+	EXPECT_EQ(ul->to_raw_html(), "<ul>text<hr /><li>1</li><li>3</li><li>5</li></ul>");
+	EXPECT_EQ(doc->select("li:eq(3)")[0]->to_text(), "5");
+	EXPECT_THROW(doc->detach(), std::invalid_argument);
+
+	html::node_ptr list = p.parse("<p>a</p> <p>b</p> <p>c</p> <p>d</p>");
+	list->walk([](html::node& n) {
+		if(n.type_node == html::node_t::text && n.get_parent()->type_node != html::node_t::tag) {
+			n.remove();
+			return false;
+		}
+		return n.type_node == html::node_t::tag && n.to_text() != "c";
+	});
+	EXPECT_EQ(list->to_raw_html(), "<p>a</p><p>b</p><p>c</p><p>d</p>");
+
+	// reading the children of a node that is being walked does not move the others
+	html::node_ptr items = p.parse("<ul><li>a</li><li>b</li><li>c</li><li>d</li></ul>");
+	std::string visited;
+	items->walk([&](html::node& n) {
+		if(n.tag_name != "li") {
+			return true;
+		}
+		visited += n.to_text();
+		if(n.to_text() == "a") {
+			n.remove();
+		} else if(n.to_text() == "b") {
+			EXPECT_EQ(n.get_parent()->size(), 3);
+			EXPECT_EQ(n.get_parent()->at(0), &n);
+		} else if(n.to_text() == "c") {
+			n.insert_before(html::utils::make_node(html::node_t::tag, "hr"));
+		}
+		return false;
+	});
+	EXPECT_EQ(visited, "abcd");
+	EXPECT_EQ(items->to_raw_html(), "<ul><li>b</li><hr /><li>c</li><li>d</li></ul>");
+	EXPECT_EQ(items->at(0)->size(), 4);
+	EXPECT_EQ(items->select("li:eq(3)")[0]->to_text(), "d");
+}
+
+TEST(Parser, DeepDocument) {
+	std::string doc;
+	for(int i = 0; i < 100000; i++) {
+		doc += "<div>x";
+	}
+	html::parser p;
+	html::node_ptr node = p.parse(doc);
+	EXPECT_EQ(node->to_raw_html().size(), 100000 * 12);
+	EXPECT_EQ(node->to_text().size(), 199999);
+	EXPECT_EQ(node->to_minified_html(), node->to_raw_html());
+	EXPECT_EQ(node->select("div div").size(), 99999);
+	html::node copy(*node);
+	EXPECT_EQ(copy.subtree_hash(), node->subtree_hash());
+	EXPECT_TRUE(html::diff(copy, *node).empty());
+	size_t count = 0;
+	copy.walk([&count](html::node&) {
+		count++;
+		return true;
+	});
+	EXPECT_EQ(count, 200000);
+}
+
+TEST(Parser, Visit) {
+	html::parser p;
+	html::node_ptr doc = p.parse("<div><p>a</p><p>b <b>c</b></p></div><ul><li>d</li></ul>");
+	const html::node& cdoc = *doc;
+	std::string order;
+	cdoc.visit([&order](const html::node& n) {
+		order += n.type_node == html::node_t::tag ? n.tag_name : n.content;
+		order += ' ';
+		return n.tag_name == "ul" ? html::visit_t::skip : html::visit_t::next;
+	}, [&order](const html::node& n) {
+		order += '/';
+		order += n.tag_name;
+		order += ' ';
+		return html::visit_t::next;
+	});
+	EXPECT_EQ(order, "div p a / /p p b  / b c / /b /p /div ul ");
+
+	std::vector<std::string> texts;
+	bool finished = doc->visit([&texts](html::node& n) {
+		if(n.type_node == html::node_t::text) {
+			texts.push_back(n.content);
+			if(n.content == "c") {
+				return html::visit_t::stop;
+			}
+		}
+		return html::visit_t::next;
+	});
+	EXPECT_FALSE(finished);
+	EXPECT_EQ(texts, std::vector<std::string>({"a", "b ", "c"}));
+
+	order.clear();
+	finished = doc->visit([](html::node&) {
+		return html::visit_t::next;
+	}, [&order](html::node& n) {
+		order += n.tag_name + ",";
+		return n.tag_name == "div" ? html::visit_t::stop : html::visit_t::next;
+	});
+	EXPECT_FALSE(finished);
+	EXPECT_EQ(order, ",p,,,b,p,div,");
+
+	order.clear();
+	finished = doc->visit([](html::node& n) {
+		return n.content == "c" ? html::visit_t::stop : html::visit_t::next;
+	}, [&order](html::node& n) {
+		order += n.tag_name + ",";
+		return html::visit_t::next;
+	});
+	EXPECT_FALSE(finished);
+	EXPECT_EQ(order, ",p,,");
+
+	size_t tags = 0;
+	cdoc.walk([&tags](const html::node& n) {
+		tags += n.type_node == html::node_t::tag;
+		return n.tag_name != "div";
+	});
+	EXPECT_EQ(tags, 3);
+}
+
+TEST(Flat, SameAsTree) {
+	html::parser p;
+	html::node_ptr doc = p.parse(R"(<!DOCTYPE html><html><body><div id="a" class="x y"><p>one <b>b</b></p><p lang="en-US">two</p><div><p>three</p></div></div>)"
+		R"(<ul><li>1</li><li class="y">2</li><li>3</li></ul><img src="a.png"><!-- c --></body></html>)");
+	html::flat_document flat(*doc);
+	std::vector<const html::node*> order(1, doc.get());
+	doc->walk([&order](html::node& n) {
+		order.push_back(&n);
+		return true;
+	});
+	ASSERT_EQ(flat.size(), order.size());
+	for(html::flat_document::handle h = 0; h < flat.size(); h++) {
+		const html::node& n = *order[h];
+		EXPECT_EQ(flat.type(h), n.type_node);
+		EXPECT_EQ(flat.tag_name(h), n.tag_name);
+		EXPECT_EQ(flat.content(h), n.content);
+		EXPECT_EQ(flat.self_closing(h), n.self_closing);
+		if(h) {
+			EXPECT_EQ(order[flat.parent(h)], n.get_parent());
+		}
+		size_t children = 0;
+		for(auto c = flat.first_child(h); c != html::flat_document::npos; c = flat.next_sibling(c)) {
+			EXPECT_EQ(order[c], n.at(children));
+			EXPECT_EQ(flat.child(h, children), c);
+			children++;
+		}
+		EXPECT_EQ(children, n.size());
+		EXPECT_EQ(flat.size(h), n.size());
+	}
+	for(const char* s : {"div p", "div > p", "p", "li:eq(1)", "li:gt(0)", "ul li:first", "[lang|=en]", ".y", "#a p:lt(1)", "div,li", "*", "img[src$=png]", "img[src^=a.]", "[class*=x]", "[lang!=en-US]", "[class~=y]"}) {
+		std::vector<html::flat_document::handle> expected;
+		for(auto n : doc->select(s)) {
+			expected.push_back(static_cast<html::flat_document::handle>(std::find(order.begin(), order.end(), n) - order.begin()));
+		}
+		EXPECT_EQ(flat.select(s), expected) << s;
+	}
+	auto li = flat.select("li.y")[0];
+	EXPECT_EQ(flat.get_attr(li, "class"), "y");
+	EXPECT_EQ(flat.get_attr(li, "class").data, flat.get_attr(li, "class").data);
+	EXPECT_EQ(flat.get_attr(li, "id").data, nullptr);
+	EXPECT_EQ(flat.get_attr(li, "id").str(), "");
+	EXPECT_EQ(flat.content(flat.child(li, 0)).str(), "2");
+	EXPECT_FALSE(flat.has_attr(li, "id"));
+	EXPECT_EQ(flat.select("p", flat.select("#a > div")[0]).size(), 1);
+	EXPECT_EQ(flat.subtree_end(li), li + 2);
+}